@@ -24,6 +24,8 @@ set Libraries= ^
     Advapi32.lib
 
 set Defines=/DSFML_STATIC
+rem Profiler zones, the frame graph and F12 traces, leave out to compile them out
+set Defines=%Defines% /DZHALE_PROFILE
 
 set FilesToCompile=..\code\main.cpp
 set Defines=%Defines% /DUNITY_BUILD
@@ -0,0 +1,362 @@
+#ifndef ZHALE_LOGGER_H
+#define ZHALE_LOGGER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <type_traits>
+
+enum LOG_LEVEL {
+  LL_DEBUG,
+  LL_INFO,
+  LL_WARNING,
+  LL_ERROR
+};
+
+struct LogRecord {
+  uint64_t time;
+  LOG_LEVEL level;
+  uint32_t length;
+  char text[240];
+};
+
+// State of one LOG call site. A site logs at most maxPerSecond messages a second. The ones past
+// that are counted, and once the second is over the log thread writes how many were left out.
+class LogSite {
+public:
+  static const uint32_t maxPerSecond = 10;
+
+  const LOG_LEVEL level;
+  const char* const file;
+  const int line;
+
+  std::atomic<uint64_t> second{0};
+  std::atomic<uint32_t> count{0};
+  std::atomic<uint32_t> suppressedCount{0};
+  // Whether the site is on the logger's list of sites with suppressed messages, next is the
+  // site after it there.
+  std::atomic<bool> listed{false};
+  LogSite* next = nullptr;
+
+  constexpr LogSite(LOG_LEVEL level, const char* file, int line) : level(level), file(file), line(line) {}
+
+  bool allow(uint64_t time);
+};
+
+// Records one thread logged that the log thread hasn't written yet. Only the owning thread
+// pushes and only the log thread pops, so neither ever waits. When it is full new messages are
+// dropped and counted instead of stalling the caller.
+class LogQueue {
+public:
+  static const uint32_t capacity = 256;
+
+  std::atomic<uint32_t> droppedCount{0};
+  // Set once the owning thread exits, the log thread frees the queue after emptying it.
+  std::atomic<bool> closed{false};
+
+  // Slot for the next record, null when the queue is full. Nothing is visible to the log
+  // thread before push.
+  LogRecord* reserve()
+  {
+    uint32_t head = writeIndex.load(std::memory_order_relaxed);
+    if(head - readIndex.load(std::memory_order_acquire) == capacity) return nullptr;
+    return &records[head % capacity];
+  }
+  void push() { writeIndex.store(writeIndex.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+  template<typename Function>
+  void popAll(Function function)
+  {
+    uint32_t tail = readIndex.load(std::memory_order_relaxed);
+    uint32_t head = writeIndex.load(std::memory_order_acquire);
+    for(; tail != head; tail++) function(records[tail % capacity]);
+    readIndex.store(tail, std::memory_order_release);
+  }
+
+  bool empty() const { return readIndex.load(std::memory_order_acquire) == writeIndex.load(std::memory_order_acquire); }
+private:
+  LogRecord records[capacity];
+  std::atomic<uint32_t> writeIndex{0};
+  std::atomic<uint32_t> readIndex{0};
+};
+
+// Writes what every thread logged on a thread of its own, so logging never waits on the terminal
+// or the disk. Messages go to stdout and to a file once one is opened, in the order they were
+// logged. Times are seconds since the logger started.
+class Logger {
+private:
+  std::mutex mutex;
+  std::vector<std::unique_ptr<LogQueue>> queues;
+  std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+  std::atomic<int> minimumLevel{LL_INFO};
+  std::ofstream file;
+  std::atomic<bool> stopping{false};
+  // Sites that left messages out since the log thread last wrote their count, pushed by any thread.
+  std::atomic<LogSite*> suppressedSites{nullptr};
+  // Started last, once everything it touches is there.
+  std::thread writer;
+
+  // Closes the thread's queue when the thread exits.
+  struct QueueOwner {
+    LogQueue* queue;
+    ~QueueOwner() { queue->closed.store(true, std::memory_order_release); }
+  };
+
+  LogQueue* addQueue()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    queues.emplace_back(new LogQueue);
+    return queues.back().get();
+  }
+
+  void pushSuppressedSite(LogSite* site)
+  {
+    LogSite* head = suppressedSites.load(std::memory_order_relaxed);
+    do site->next = head;
+    while(!suppressedSites.compare_exchange_weak(head, site, std::memory_order_release, std::memory_order_relaxed));
+  }
+
+  // Adds a record with the count of every listed site whose second is over, all of them when
+  // stopping. The others stay listed.
+  void takeSuppressedCounts(std::vector<LogRecord>& records, bool all)
+  {
+    uint64_t currentSecond = now() / 1000000000u + 1;
+    LogSite* site = suppressedSites.exchange(nullptr, std::memory_order_acquire);
+    while(site)
+    {
+      LogSite* next = site->next;
+      if(!all && site->second.load(std::memory_order_relaxed) == currentSecond)
+      {
+	pushSuppressedSite(site);
+	site = next;
+	continue;
+      }
+
+      // Unlisted before the count is taken, a message left out after that lists the site again.
+      site->listed.store(false);
+      uint32_t suppressedCount = site->suppressedCount.exchange(0);
+      if(suppressedCount > 0)
+      {
+	const char* file = site->file;
+	for(const char* c = site->file; *c; c++) if(*c == '/' || *c == '\\') file = c + 1;
+	LogRecord record;
+	record.time = site->second.load(std::memory_order_relaxed) * 1000000000u;
+	record.level = site->level;
+	int length = snprintf(record.text, sizeof(record.text), "%s:%d: %u more like it left out", file, site->line, suppressedCount);
+	record.length = (uint32_t)std::min(std::max(length, 0), (int)sizeof(record.text) - 1);
+	records.push_back(record);
+      }
+      site = next;
+    }
+  }
+
+  static const char* getLevelName(LOG_LEVEL level)
+  {
+    switch(level)
+    {
+    case LL_DEBUG :   return "debug";
+    case LL_INFO :    return "info";
+    case LL_WARNING : return "warning";
+    default :         return "error";
+    }
+  }
+
+  // Returns false when there was nothing to write.
+  bool writePending(std::vector<LogRecord>& records, bool stopped)
+  {
+    records.clear();
+    std::vector<uint32_t> dropped;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for(size_t i = 0; i < queues.size();)
+      {
+	LogQueue& queue = *queues[i];
+	bool closed = queue.closed.load(std::memory_order_acquire);
+	queue.popAll([&records](const LogRecord& record) { records.push_back(record); });
+	uint32_t droppedCount = queue.droppedCount.exchange(0, std::memory_order_relaxed);
+	if(droppedCount > 0) dropped.push_back(droppedCount);
+	if(closed && queue.empty()) queues.erase(queues.begin() + i);
+	else i++;
+      }
+    }
+    takeSuppressedCounts(records, stopped);
+    if(records.empty() && dropped.empty()) return false;
+
+    std::stable_sort(records.begin(), records.end(), [](const LogRecord& a, const LogRecord& b) { return a.time < b.time; });
+    std::string lines;
+    char prefix[48];
+    for(const LogRecord& record : records)
+    {
+      snprintf(prefix, sizeof(prefix), "%10.4f %-7s ", (double)record.time * 1e-9, getLevelName(record.level));
+      lines.append(prefix);
+      lines.append(record.text, record.length);
+      lines.push_back('\n');
+    }
+    for(uint32_t droppedCount : dropped)
+      lines.append("Log: " + std::to_string(droppedCount) + " messages dropped, a thread logged faster than they were written\n");
+
+    std::cout << lines << std::flush;
+    std::lock_guard<std::mutex> lock(mutex);
+    if(file.is_open()) file << lines << std::flush;
+    return true;
+  }
+
+  void writerLoop()
+  {
+    std::vector<LogRecord> records;
+    while(!stopping.load(std::memory_order_acquire))
+    {
+      if(!writePending(records, false)) std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    while(writePending(records, true)) {}
+  }
+
+  Logger() : writer([this] { writerLoop(); }) {}
+public:
+  ~Logger()
+  {
+    stopping.store(true, std::memory_order_release);
+    writer.join();
+  }
+
+  static Logger& get()
+  {
+    static Logger logger;
+    return logger;
+  }
+
+  uint64_t now() const
+  {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+  }
+
+  // The lock is only taken the first time a thread logs.
+  LogQueue& getThreadQueue()
+  {
+    thread_local QueueOwner owner = {addQueue()};
+    return *owner.queue;
+  }
+
+  bool isEnabled(LOG_LEVEL level) const { return (int)level >= minimumLevel.load(std::memory_order_relaxed); }
+  void setMinimumLevel(LOG_LEVEL level) { minimumLevel.store((int)level, std::memory_order_relaxed); }
+
+  bool openFile(const std::string& filename)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    file.open(filename, std::ios::trunc);
+    return file.is_open();
+  }
+
+  // Hands a site that just left a message out to the log thread, unless it already has it.
+  void addSuppressedSite(LogSite& site)
+  {
+    if(!site.listed.load() && !site.listed.exchange(true)) pushSuppressedSite(&site);
+  }
+};
+
+inline bool LogSite::allow(uint64_t time)
+{
+  uint64_t currentSecond = time / 1000000000u + 1;
+  if(second.load(std::memory_order_relaxed) != currentSecond)
+  {
+    second.store(currentSecond, std::memory_order_relaxed);
+    count.store(0, std::memory_order_relaxed);
+  }
+  if(count.fetch_add(1, std::memory_order_relaxed) < maxPerSecond) return true;
+  suppressedCount.fetch_add(1);
+  Logger::get().addSuppressedSite(*this);
+  return false;
+}
+
+
+// Formats a message straight into the calling thread's queue, it is pushed when the statement ends.
+class LogMessage {
+private:
+  LogQueue& queue;
+  LogRecord* record;
+
+  void append(const char* text, size_t length)
+  {
+    if(!record) return;
+    length = std::min(length, sizeof(record->text) - record->length);
+    memcpy(record->text + record->length, text, length);
+    record->length += (uint32_t)length;
+  }
+public:
+  LogMessage(LOG_LEVEL level, uint64_t time) : queue(Logger::get().getThreadQueue()), record(queue.reserve())
+  {
+    if(!record)
+    {
+      queue.droppedCount.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    record->time = time;
+    record->level = level;
+    record->length = 0;
+  }
+  LogMessage(const LogMessage&) = delete;
+
+  ~LogMessage()
+  {
+    if(record) queue.push();
+  }
+
+  LogMessage& operator<<(const char* text) { append(text, strlen(text)); return *this; }
+  LogMessage& operator<<(const std::string& text) { append(text.data(), text.size()); return *this; }
+  LogMessage& operator<<(char character) { append(&character, 1); return *this; }
+  LogMessage& operator<<(bool value) { return *this << (value ? "true" : "false"); }
+
+  LogMessage& operator<<(double number)
+  {
+    char buffer[32];
+    int length = snprintf(buffer, sizeof(buffer), "%g", number);
+    append(buffer, (size_t)std::max(length, 0));
+    return *this;
+  }
+
+  // Digits are written by hand, snprintf takes longer than the rest of a message together.
+  template<typename T>
+  typename std::enable_if<std::is_integral<T>::value, LogMessage&>::type operator<<(T number)
+  {
+    char buffer[24];
+    char* digits = buffer + sizeof(buffer);
+    bool negative = number < 0;
+    uint64_t value = negative ? 0 - (uint64_t)number : (uint64_t)number;
+    do {
+      *--digits = (char)('0' + value % 10);
+      value /= 10;
+    } while(value != 0);
+    if(negative) *--digits = '-';
+    append(digits, (size_t)(buffer + sizeof(buffer) - digits));
+    return *this;
+  }
+};
+
+// LOG_WARNING("Level: " << filename << " couldn't be reloaded !") formats on the calling thread
+// and returns without waiting on any output. Messages below the logger's minimum level cost a
+// load and a compare.
+#define LOG(level, message)						\
+  do {									\
+    if(Logger::get().isEnabled(level)) {				\
+      static LogSite logSite(level, __FILE__, __LINE__);		\
+      uint64_t logTime = Logger::get().now();				\
+      if(logSite.allow(logTime)) LogMessage(level, logTime) << message;	\
+    }									\
+  } while(0)
+
+#define LOG_DEBUG(message)   LOG(LL_DEBUG, message)
+#define LOG_INFO(message)    LOG(LL_INFO, message)
+#define LOG_WARNING(message) LOG(LL_WARNING, message)
+#define LOG_ERROR(message)   LOG(LL_ERROR, message)
+
+#endif
@@ -3,11 +3,26 @@
 #include <iostream>
 #include <vector>
 #include <algorithm>
-#include <list>
-
+#include <memory>
+#include <unordered_map>
+#include <set>
+#include <fstream>
+#include <atomic>
+#include "platform.h"
+#include "thread_pool.h"
+#include "profiler.h"
+#include "logger.h"
+#include <cmath>
+#include <limits>
+#include <sstream>
+#include <iomanip>
+
+typedef uint8_t  uint8;
 typedef uint16_t uint16;
 typedef uint32_t uint32;
+typedef uint64_t uint64;
 typedef int32_t  int32;
+typedef int64_t  int64;
 typedef float    f32;
 typedef double   real64;
 
@@ -23,6 +38,72 @@ public:
     memset(keysPressed , 0, sizeof(bool) * keyCount);
     memset(keysReleased, 0, sizeof(bool) * keyCount);
   }
+
+  // Takes in the input of a later frame, presses and releases not seen yet are kept.
+  void add(const Input& later) {
+    for(uint16 key = 0; key < keyCount; key++)
+    {
+      keysDown[key]      = later.keysDown[key];
+      keysPressed[key]  |= later.keysPressed[key];
+      keysReleased[key] |= later.keysReleased[key];
+    }
+  }
+};
+
+// Turns frame times into a whole number of fixed simulation steps. What is left over is carried
+// to the next frame and tells how far between the last two steps the frame is, for rendering.
+class FixedTimestep {
+public:
+  const f32 stepTime;
+  // A frame never runs more steps than this, after a long stall the time past it is dropped
+  // instead of making every following frame slower trying to catch up.
+  const uint32 maxStepsPerFrame;
+
+  FixedTimestep(f32 stepTime, uint32 maxStepsPerFrame) : stepTime(stepTime), maxStepsPerFrame(maxStepsPerFrame) {}
+
+  // Returns how many steps to run for a frame that took frameTime seconds.
+  uint32 advance(f32 frameTime)
+  {
+    accumulator += frameTime;
+    uint32 stepCount = std::min((uint32)(accumulator / stepTime), maxStepsPerFrame);
+    accumulator -= (f32)stepCount * stepTime;
+    if(stepCount == maxStepsPerFrame) accumulator = std::min(accumulator, stepTime * 0.999f);
+    return stepCount;
+  }
+
+  // 0 right at the last step, close to 1 just before the next one.
+  f32 getAlpha() const { return accumulator / stepTime; }
+private:
+  f32 accumulator = 0.0f;
+};
+
+// Hands the latest of the values one thread publishes to another thread, without either ever
+// waiting on the other. Of the three slots the writer fills one, the reader holds one and the
+// third is the last one published, swapped with the other two by an atomic exchange. Values the
+// reader never got to are skipped.
+template <typename T>
+class TripleBuffer {
+private:
+  static const uint32 freshBit = 4;
+
+  T slots[3];
+  // Index of the slot last published, with freshBit set until the reader takes it.
+  std::atomic<uint32> latest{0};
+  uint32 writing = 1;
+  uint32 reading = 2;
+public:
+  // Only the writer thread calls these two.
+  T& getWriteSlot() { return slots[writing]; }
+  void publish() { writing = latest.exchange(writing | freshBit, std::memory_order_acq_rel) & ~freshBit; }
+
+  // Last value published, the one from the call before when nothing new came since. Only the
+  // reader thread calls it, the value stays untouched until its next call.
+  const T& read()
+  {
+    if(latest.load(std::memory_order_relaxed) & freshBit)
+      reading = latest.exchange(reading, std::memory_order_acq_rel) & ~freshBit;
+    return slots[reading];
+  }
 };
 
 enum TILE_TYPE {
@@ -33,309 +114,3560 @@ enum TILE_TYPE {
   TT_STAIRCASE_DOWN
 };
 
-const sf::Color staircaseDownColor = sf::Color(231,20,129);
-const sf::Color staircaseUpColor   = sf::Color(19,144,146);
+const sf::Color staircaseDownColor = sf::Color(231,20,129);
+const sf::Color staircaseUpColor   = sf::Color(19,144,146);
+
+// View of a single layer inside a Grid3D, tiles are stored row after row.
+template <typename T>
+struct GridLayerView {
+  T* tiles;
+  uint32 width;
+  uint32 height;
+
+  GridLayerView(T* tiles, uint32 width, uint32 height) : tiles(tiles), width(width), height(height) {}
+  // Lets a writable layer be passed where a read only one is expected.
+  template <typename U>
+  GridLayerView(const GridLayerView<U>& other) : tiles(other.tiles), width(other.width), height(other.height) {}
+
+  T* row(uint32 y) const { return tiles + (size_t)y * width; }
+  TILE_TYPE get(uint32 x, uint32 y) const { return (TILE_TYPE)tiles[(size_t)y * width + x]; }
+};
+
+typedef GridLayerView<uint8>       GridLayer;
+typedef GridLayerView<const uint8> ConstGridLayer;
+
+// All layers of a level in one contiguous block of one byte tiles,
+// x is the fastest changing coordinate then y then z.
+class Grid3D {
+private:
+  std::vector<uint8> tiles;
+  uint32 width  = 0;
+  uint32 height = 0;
+  uint32 depth  = 0;
+  size_t rowStride   = 0;
+  size_t layerStride = 0;
+public:
+  void resize(uint32 newWidth, uint32 newHeight, uint32 newDepth)
+  {
+    width  = newWidth;
+    height = newHeight;
+    depth  = newDepth;
+    rowStride   = width;
+    layerStride = rowStride * height;
+    tiles.assign(layerStride * depth, (uint8)TT_VOID);
+  }
+
+  uint32 getWidth()  const { return width; }
+  uint32 getHeight() const { return height; }
+  uint32 getDepth()  const { return depth; }
+  size_t getSizeInBytes() const { return tiles.size(); }
+
+  bool contains(int32 x, int32 y, int32 z) const
+  {
+    return x >= 0 && y >= 0 && z >= 0 && (uint32)x < width && (uint32)y < height && (uint32)z < depth;
+  }
+
+  TILE_TYPE get(uint32 x, uint32 y, uint32 z) const
+  {
+    return (TILE_TYPE)tiles[z * layerStride + y * rowStride + x];
+  }
+
+  void set(uint32 x, uint32 y, uint32 z, TILE_TYPE tileType)
+  {
+    tiles[z * layerStride + y * rowStride + x] = (uint8)tileType;
+  }
+
+  const uint8* row(uint32 y, uint32 z) const { return &tiles[z * layerStride + y * rowStride]; }
+
+  GridLayer      layer(uint32 z)       { return GridLayer{&tiles[z * layerStride], width, height}; }
+  ConstGridLayer layer(uint32 z) const { return ConstGridLayer{&tiles[z * layerStride], width, height}; }
+};
+
+const int32 chunkShift = 5;
+const int32 chunkSize  = 1 << chunkShift;
+const int32 chunkMask  = chunkSize - 1;
+
+// Chunk coordinates packed into one key for the maps of chunks, getChunkCoordinates unpacks it.
+inline uint64 getChunkKey(int32 chunkX, int32 chunkY) { return ((uint64)(uint32)chunkX << 32) | (uint32)chunkY; }
+inline sf::Vector2i getChunkCoordinates(uint64 key) { return sf::Vector2i((int32)(key >> 32), (int32)(uint32)key); }
+
+struct TileChunk {
+  uint8 tiles[chunkSize * chunkSize];
+
+  uint8* row(int32 localY) { return &tiles[localY * chunkSize]; }
+  const uint8* row(int32 localY) const { return &tiles[localY * chunkSize]; }
+};
+
+// Chunk rect covering every chunk that overlaps tileRect, empty if tileRect is empty.
+sf::IntRect getChunkRect(const sf::IntRect& tileRect)
+{
+  if(tileRect.width <= 0 || tileRect.height <= 0) return sf::IntRect();
+  int32 minX = tileRect.left >> chunkShift;
+  int32 minY = tileRect.top  >> chunkShift;
+  int32 maxX = (tileRect.left + tileRect.width  - 1) >> chunkShift;
+  int32 maxY = (tileRect.top  + tileRect.height - 1) >> chunkShift;
+  return sf::IntRect(minX, minY, maxX - minX + 1, maxY - minY + 1);
+}
+
+// Every tile from minTile to maxTile inclusive, row by row. Nothing is stored, the tiles are
+// made up while iterating, so walking a span never allocates.
+class TileSpan {
+public:
+  class iterator {
+  public:
+    iterator(int32 x, int32 y, int32 minX, int32 maxX) : x(x), y(y), minX(minX), maxX(maxX) {}
+
+    sf::Vector2i operator*() const { return sf::Vector2i(x, y); }
+    bool operator!=(const iterator& other) const { return x != other.x || y != other.y; }
+    bool operator==(const iterator& other) const { return !(*this != other); }
+
+    iterator& operator++()
+    {
+      if(x == maxX) { x = minX; y++; }
+      else x++;
+      return *this;
+    }
+  private:
+    int32 x, y, minX, maxX;
+  };
+
+  TileSpan(sf::Vector2i minTile, sf::Vector2i maxTile) : minTile(minTile), maxTile(maxTile) {}
+
+  // Tiles touched by the points between a and b, on both axes. Coordinates are floored, so
+  // -0.5 is in tile -1.
+  static TileSpan between(sf::Vector2f a, sf::Vector2f b)
+  {
+    return TileSpan(sf::Vector2i((int32)std::floor(std::min(a.x, b.x)), (int32)std::floor(std::min(a.y, b.y))),
+		    sf::Vector2i((int32)std::floor(std::max(a.x, b.x)), (int32)std::floor(std::max(a.y, b.y))));
+  }
+
+  bool empty() const { return maxTile.x < minTile.x || maxTile.y < minTile.y; }
+  uint32 size() const { return empty() ? 0 : (uint32)(maxTile.x - minTile.x + 1) * (uint32)(maxTile.y - minTile.y + 1); }
+
+  iterator begin() const { return empty() ? end() : iterator(minTile.x, minTile.y, minTile.x, maxTile.x); }
+  iterator end() const { return iterator(minTile.x, maxTile.y + 1, minTile.x, maxTile.x); }
+private:
+  sf::Vector2i minTile, maxTile;
+};
+
+struct TileChange {
+  int32 x, y, z;
+  uint8 tileType;
+};
+
+// Where chunks come from when they become resident. A source has to be able to hand out
+// any chunk at any time, the world only keeps the ones around the player.
+class ChunkSource {
+public:
+  virtual ~ChunkSource() {}
+
+  // Size of the world in tiles, z is the number of floors.
+  virtual sf::Vector3i getSize() const = 0;
+  // Returns the tiles of a chunk or null if the chunk is nothing but void. Sources that keep their
+  // chunks in memory hand out their own copy, which has to stay valid as long as the source lives,
+  // everything else fills scratch and returns it.
+  virtual const TileChunk* loadChunk(int32 chunkX, int32 chunkY, int32 z, TileChunk& scratch) = 0;
+};
+
+// Serves chunks out of a fully decoded level, used for the PNG maps.
+class GridChunkSource : public ChunkSource {
+private:
+  Grid3D grid;
+public:
+  explicit GridChunkSource(Grid3D&& loadedGrid) : grid(std::move(loadedGrid)) {}
+
+  // Swaps in a freshly imported layer of the same size, returns the tiles that actually differ.
+  // Rows that didn't change are skipped with a single compare.
+  std::vector<TileChange> replaceLayer(int32 z, ConstGridLayer newLayer)
+  {
+    std::vector<TileChange> changes;
+    GridLayer layer = grid.layer(z);
+    for(uint32 y = 0; y < layer.height; y++)
+    {
+      uint8* row = layer.row(y);
+      const uint8* newRow = newLayer.row(y);
+      if(memcmp(row, newRow, layer.width) == 0) continue;
+
+      for(uint32 x = 0; x < layer.width; x++)
+      {
+	if(row[x] == newRow[x]) continue;
+	row[x] = newRow[x];
+	changes.push_back({(int32)x, (int32)y, z, newRow[x]});
+      }
+    }
+    return changes;
+  }
+
+  sf::Vector3i getSize() const override
+  {
+    return sf::Vector3i((int32)grid.getWidth(), (int32)grid.getHeight(), (int32)grid.getDepth());
+  }
+
+  const TileChunk* loadChunk(int32 chunkX, int32 chunkY, int32 z, TileChunk& chunk) override
+  {
+    bool empty = true;
+    for(int32 localY = 0; localY < chunkSize; localY++)
+    {
+      uint8* chunkRow = chunk.row(localY);
+      int32 y = (chunkY << chunkShift) + localY;
+      if(!grid.contains(0, y, z)) { memset(chunkRow, TT_VOID, chunkSize); continue; }
+
+      const uint8* row = grid.row(y, z);
+      for(int32 localX = 0; localX < chunkSize; localX++)
+      {
+	int32 x = (chunkX << chunkShift) + localX;
+	chunkRow[localX] = grid.contains(x, y, z) ? row[x] : (uint8)TT_VOID;
+	if(chunkRow[localX] != TT_VOID) empty = false;
+      }
+    }
+    return empty ? nullptr : &chunk;
+  }
+};
+
+// Procedural test world of walled rooms with doors, one room per chunk and roughly one chunk
+// in four left empty. Nothing is stored, so it can be as big as needed for paging tests.
+class GeneratedChunkSource : public ChunkSource {
+private:
+  sf::Vector3i size;
+public:
+  explicit GeneratedChunkSource(sf::Vector3i worldSize) : size(worldSize) {}
+
+  sf::Vector3i getSize() const override { return size; }
+
+  const TileChunk* loadChunk(int32 chunkX, int32 chunkY, int32 z, TileChunk& chunk) override
+  {
+    uint32 hash = (uint32)chunkX * 73856093u ^ (uint32)chunkY * 19349663u ^ (uint32)z * 83492791u;
+    hash = (hash ^ (hash >> 13)) * 1274126177u;
+    if((hash >> 28) % 4 == 0) return nullptr;
+
+    bool empty = true;
+    for(int32 localY = 0; localY < chunkSize; localY++)
+    {
+      uint8* chunkRow = chunk.row(localY);
+      int32 y = (chunkY << chunkShift) + localY;
+      for(int32 localX = 0; localX < chunkSize; localX++)
+      {
+	int32 x = (chunkX << chunkShift) + localX;
+	TILE_TYPE tileType = TT_FLOOR;
+	if(x < 0 || y < 0 || x >= size.x || y >= size.y) tileType = TT_VOID;
+	else if((localX == 0 || localY == 0) && localX != chunkSize / 2 && localY != chunkSize / 2) tileType = TT_WALL;
+	else if(localX == chunkSize / 2 && localY == chunkSize / 2 && (hash & 0xF) == 0)
+	  tileType = (z % 2 == 0) ? TT_STAIRCASE_UP : TT_STAIRCASE_DOWN;
+
+	chunkRow[localX] = (uint8)tileType;
+	if(tileType != TT_VOID) empty = false;
+      }
+    }
+    return empty ? nullptr : &chunk;
+  }
+};
+
+// Map colors packed the way sf::Image keeps pixels in memory, red in the lowest byte.
+uint32 packPixel(sf::Color color)
+{
+  return (uint32)color.r | (uint32)color.g << 8 | (uint32)color.b << 16 | (uint32)color.a << 24;
+}
+
+const uint32 tilePaletteSize = 4;
+
+struct TilePalette {
+  uint32 pixels[tilePaletteSize];
+  uint8  tileTypes[tilePaletteSize];
+};
+
+TilePalette getTilePalette()
+{
+  TilePalette palette = {
+    {packPixel(sf::Color::White), packPixel(sf::Color::Black), packPixel(staircaseDownColor), packPixel(staircaseUpColor)},
+    {TT_FLOOR, TT_WALL, TT_STAIRCASE_DOWN, TT_STAIRCASE_UP}
+  };
+  return palette;
+}
+
+// Fully transparent pixels are void on purpose, any other color outside of the palette
+// is loaded as void too but counted, so the importer can warn about it.
+size_t classifyPixelsScalar(const uint8* pixels, uint8* tiles, size_t count, const TilePalette& palette)
+{
+  size_t unknownCount = 0;
+  for(size_t i = 0; i < count; i++)
+  {
+    uint32 pixel;
+    memcpy(&pixel, pixels + i * 4, sizeof(pixel));
+
+    uint8 tileType = TT_VOID;
+    bool known = (pixel >> 24) == 0;
+    for(uint32 j = 0; j < tilePaletteSize; j++)
+      if(pixel == palette.pixels[j]) { tileType = palette.tileTypes[j]; known = true; }
+
+    tiles[i] = tileType;
+    if(!known) unknownCount++;
+  }
+  return unknownCount;
+}
+
+#ifdef ZHALE_X64
+// 16 pixels a step: every palette color is compared against 4 pixels at once, matches select the
+// tile type and the four 32 bit results are narrowed down to 16 tile bytes.
+size_t classifyPixelsSse2(const uint8* pixels, uint8* tiles, size_t count, const TilePalette& palette)
+{
+  __m128i colors[tilePaletteSize], tileTypes[tilePaletteSize];
+  for(uint32 j = 0; j < tilePaletteSize; j++)
+  {
+    colors[j]    = _mm_set1_epi32((int32)palette.pixels[j]);
+    tileTypes[j] = _mm_set1_epi32(palette.tileTypes[j]);
+  }
+  __m128i alphaMask = _mm_set1_epi32((int32)0xFF000000);
+  __m128i zero      = _mm_setzero_si128();
+  // Every known pixel subtracts one (an all set mask) from its lane.
+  __m128i knownCounts = _mm_setzero_si128();
+
+  size_t i = 0;
+  for(; i + 16 <= count; i += 16)
+  {
+    __m128i result[4];
+    for(uint32 block = 0; block < 4; block++)
+    {
+      __m128i pixel = _mm_loadu_si128((const __m128i*)(pixels + (i + block * 4) * 4));
+      __m128i known = _mm_cmpeq_epi32(_mm_and_si128(pixel, alphaMask), zero);
+      __m128i tileType = zero;
+      for(uint32 j = 0; j < tilePaletteSize; j++)
+      {
+	__m128i match = _mm_cmpeq_epi32(pixel, colors[j]);
+	tileType = _mm_or_si128(tileType, _mm_and_si128(match, tileTypes[j]));
+	known    = _mm_or_si128(known, match);
+      }
+      knownCounts = _mm_sub_epi32(knownCounts, known);
+      result[block] = tileType;
+    }
+    __m128i packed = _mm_packus_epi16(_mm_packs_epi32(result[0], result[1]), _mm_packs_epi32(result[2], result[3]));
+    _mm_storeu_si128((__m128i*)(tiles + i), packed);
+  }
+
+  uint32 lanes[4];
+  _mm_storeu_si128((__m128i*)lanes, knownCounts);
+  size_t unknownCount = i - ((size_t)lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+  return unknownCount + classifyPixelsScalar(pixels + i * 4, tiles + i, count - i, palette);
+}
+
+// Same as the SSE2 version with 8 pixels per compare and 32 pixels a step. The packs work per
+// 128 bit lane, so the packed dwords are shuffled back into pixel order before the store.
+ZHALE_TARGET_AVX2
+size_t classifyPixelsAvx2(const uint8* pixels, uint8* tiles, size_t count, const TilePalette& palette)
+{
+  __m256i colors[tilePaletteSize], tileTypes[tilePaletteSize];
+  for(uint32 j = 0; j < tilePaletteSize; j++)
+  {
+    colors[j]    = _mm256_set1_epi32((int32)palette.pixels[j]);
+    tileTypes[j] = _mm256_set1_epi32(palette.tileTypes[j]);
+  }
+  __m256i alphaMask   = _mm256_set1_epi32((int32)0xFF000000);
+  __m256i zero        = _mm256_setzero_si256();
+  __m256i knownCounts = _mm256_setzero_si256();
+  __m256i pixelOrder  = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+  size_t i = 0;
+  for(; i + 32 <= count; i += 32)
+  {
+    __m256i result[4];
+    for(uint32 block = 0; block < 4; block++)
+    {
+      __m256i pixel = _mm256_loadu_si256((const __m256i*)(pixels + (i + block * 8) * 4));
+      __m256i known = _mm256_cmpeq_epi32(_mm256_and_si256(pixel, alphaMask), zero);
+      __m256i tileType = zero;
+      for(uint32 j = 0; j < tilePaletteSize; j++)
+      {
+	__m256i match = _mm256_cmpeq_epi32(pixel, colors[j]);
+	tileType = _mm256_or_si256(tileType, _mm256_and_si256(match, tileTypes[j]));
+	known    = _mm256_or_si256(known, match);
+      }
+      knownCounts = _mm256_sub_epi32(knownCounts, known);
+      result[block] = tileType;
+    }
+    __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(result[0], result[1]), _mm256_packs_epi32(result[2], result[3]));
+    _mm256_storeu_si256((__m256i*)(tiles + i), _mm256_permutevar8x32_epi32(packed, pixelOrder));
+  }
+
+  uint32 lanes[8];
+  _mm256_storeu_si256((__m256i*)lanes, knownCounts);
+  size_t knownCount = 0;
+  for(uint32 lane = 0; lane < 8; lane++) knownCount += lanes[lane];
+  return (i - knownCount) + classifyPixelsSse2(pixels + i * 4, tiles + i, count - i, palette);
+}
+#endif
+
+// Turns count RGBA pixels into tiles with the widest instruction set the CPU has,
+// returns how many pixels had a color outside of the palette.
+size_t classifyPixels(const uint8* pixels, uint8* tiles, size_t count, const TilePalette& palette)
+{
+#ifdef ZHALE_X64
+  static const bool hasAvx2 = cpuSupportsAvx2();
+  if(hasAvx2) return classifyPixelsAvx2(pixels, tiles, count, palette);
+  return classifyPixelsSse2(pixels, tiles, count, palette);
+#else
+  return classifyPixelsScalar(pixels, tiles, count, palette);
+#endif
+}
+
+// Baked level file, written by -bake and mapped as is by LevelFileChunkSource. Everything is
+// stored little endian and laid out so the mapped bytes can be used without any parsing:
+//   header
+//   LevelFileLayer for every floor, the size of the PNG the floor was baked from
+//   uint32 chunk table, chunksX * chunksY per floor, 0 for void chunks otherwise chunk number + 1
+//   chunk data, the non void chunks as TileChunk one after another
+const char   levelFileMagic[4] = {'Z', 'L', 'V', 'L'};
+const uint32 levelFileVersion  = 1;
+
+struct LevelFileHeader {
+  char   magic[4];
+  uint32 version;
+  uint32 width;
+  uint32 height;
+  uint32 depth;
+  uint32 chunkSize;
+  uint32 chunksX;
+  uint32 chunksY;
+  uint32 chunkCount;
+  uint32 reserved;
+  uint64 layerTableOffset;
+  uint64 chunkTableOffset;
+  uint64 chunkDataOffset;
+};
+static_assert(sizeof(LevelFileHeader) == 64, "LevelFileHeader layout is part of the file format");
+
+struct LevelFileLayer {
+  uint32 width;
+  uint32 height;
+};
+
+bool bakeLevelFile(const Grid3D& grid, const std::vector<sf::Vector2u>& layerSizes, const std::string& filename)
+{
+  LevelFileHeader header = {};
+  memcpy(header.magic, levelFileMagic, sizeof(header.magic));
+  header.version   = levelFileVersion;
+  header.width     = grid.getWidth();
+  header.height    = grid.getHeight();
+  header.depth     = grid.getDepth();
+  header.chunkSize = chunkSize;
+  header.chunksX   = (header.width  + chunkSize - 1) / chunkSize;
+  header.chunksY   = (header.height + chunkSize - 1) / chunkSize;
+
+  // Grid is copied since the source takes ownership, baking is offline so that's fine.
+  GridChunkSource source{Grid3D(grid)};
+  std::vector<uint32> chunkTable((size_t)header.chunksX * header.chunksY * header.depth);
+  std::vector<TileChunk> chunks;
+  TileChunk scratch;
+  for(uint32 z = 0; z < header.depth; z++)
+    for(uint32 chunkY = 0; chunkY < header.chunksY; chunkY++)
+      for(uint32 chunkX = 0; chunkX < header.chunksX; chunkX++)
+      {
+	if(!source.loadChunk((int32)chunkX, (int32)chunkY, (int32)z, scratch)) continue;
+	chunks.push_back(scratch);
+	chunkTable[((size_t)z * header.chunksY + chunkY) * header.chunksX + chunkX] = (uint32)chunks.size();
+      }
+
+  std::vector<LevelFileLayer> layers(header.depth);
+  for(uint32 z = 0; z < header.depth && z < layerSizes.size(); z++) layers[z] = {layerSizes[z].x, layerSizes[z].y};
+
+  header.chunkCount       = (uint32)chunks.size();
+  header.layerTableOffset = sizeof(LevelFileHeader);
+  header.chunkTableOffset = header.layerTableOffset + layers.size() * sizeof(LevelFileLayer);
+  header.chunkDataOffset  = header.chunkTableOffset + chunkTable.size() * sizeof(uint32);
+
+  std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+  if(!file) return false;
+  file.write((const char*)&header, sizeof(header));
+  if(!layers.empty())     file.write((const char*)&layers[0], layers.size() * sizeof(LevelFileLayer));
+  if(!chunkTable.empty()) file.write((const char*)&chunkTable[0], chunkTable.size() * sizeof(uint32));
+  if(!chunks.empty())     file.write((const char*)&chunks[0], chunks.size() * sizeof(TileChunk));
+  return (bool)file;
+}
+
+// Serves chunks straight out of a mapped baked level. Opening only checks the header
+// against the file size, so it costs the same no matter how many floors the level has.
+class LevelFileChunkSource : public ChunkSource {
+private:
+  MappedFile file;
+  const LevelFileHeader* header = nullptr;
+  const LevelFileLayer*  layers = nullptr;
+  const uint32*          chunkTable = nullptr;
+  const TileChunk*       chunks = nullptr;
+public:
+  bool open(const std::string& filename)
+  {
+    if(!file.open(filename)) return false;
+
+    const uint8* data = (const uint8*)file.getData();
+    size_t size = file.getSize();
+    header = (const LevelFileHeader*)data;
+
+    bool valid = size >= sizeof(LevelFileHeader) &&
+      memcmp(header->magic, levelFileMagic, sizeof(levelFileMagic)) == 0 &&
+      header->version == levelFileVersion &&
+      header->chunkSize == chunkSize &&
+      header->layerTableOffset + (uint64)header->depth * sizeof(LevelFileLayer) <= header->chunkTableOffset &&
+      header->chunkTableOffset + (uint64)header->chunksX * header->chunksY * header->depth * sizeof(uint32) <= header->chunkDataOffset &&
+      header->chunkDataOffset  + (uint64)header->chunkCount * sizeof(TileChunk) <= size;
+    if(!valid)
+    {
+      file.close();
+      header = nullptr;
+      return false;
+    }
+
+    layers     = (const LevelFileLayer*)(data + header->layerTableOffset);
+    chunkTable = (const uint32*)(data + header->chunkTableOffset);
+    chunks     = (const TileChunk*)(data + header->chunkDataOffset);
+    return true;
+  }
+
+  sf::Vector3i getSize() const override
+  {
+    return sf::Vector3i((int32)header->width, (int32)header->height, (int32)header->depth);
+  }
+
+  sf::Vector2u getLayerSize(uint32 z) const { return sf::Vector2u(layers[z].width, layers[z].height); }
+
+  const TileChunk* loadChunk(int32 chunkX, int32 chunkY, int32 z, TileChunk&) override
+  {
+    if(chunkX < 0 || chunkY < 0 || z < 0 ||
+       (uint32)chunkX >= header->chunksX || (uint32)chunkY >= header->chunksY || (uint32)z >= header->depth) return nullptr;
+
+    uint32 chunkNumber = chunkTable[((size_t)z * header->chunksY + chunkY) * header->chunksX + chunkX];
+    if(chunkNumber == 0 || chunkNumber > header->chunkCount) return nullptr;
+    return &chunks[chunkNumber - 1];
+  }
+};
+
+// Sparse tile storage, one hash map of chunks per floor. Only chunks that are resident and
+// hold something other than void take memory, everything else reads as void.
+//
+// Chunks are streamed in by a loader thread: updateResidency only decides what should be
+// resident and takes in what the loader finished, so the main loop never waits on the source.
+// The player's floor is always wanted, and so is every floor a staircase near the player leads
+// to, so those are in memory before the player gets there. Floors more than one floor away
+// from the player that aren't wanted are dropped.
+class ChunkedWorld {
+private:
+  struct ResidentChunk {
+    // Points either at owned or straight into the source, e.g. a mapped level file.
+    const TileChunk* tiles;
+    std::unique_ptr<TileChunk> owned;
+    // Changes whenever the tiles do, anything built from a chunk is stale once this moved on.
+    uint32 revision;
+    // Bit x of row y is set when that tile is a wall, kept in step with tiles.
+    uint32 solidRows[chunkSize];
+    bool hasStaircaseUp;
+    bool hasStaircaseDown;
+  };
+  typedef std::unordered_map<uint64, ResidentChunk> ChunkMap;
+
+  struct Floor {
+    ChunkMap chunks;
+    // Chunks this floor should have, empty if the floor isn't wanted.
+    sf::IntRect wantedChunks;
+    // Chunks already handed to the loader, so they aren't asked for again every frame.
+    sf::IntRect requestedChunks;
+    // Source version of the last edit to each edited chunk, older loads of them are stale.
+    std::unordered_map<uint64, uint32> editedChunks;
+  };
+
+  struct LoadedChunk {
+    int32 chunkX, chunkY, z;
+    const TileChunk* tiles;
+    std::unique_ptr<TileChunk> owned;
+    uint32 sourceVersion;
+  };
+
+  struct ChangeBatch {
+    uint32 sourceVersion;
+    std::vector<TileChange> changes;
+  };
+
+  std::vector<Floor> floors;
+  std::unique_ptr<ChunkSource> source;
+  sf::Vector3i size;
+  sf::IntRect lastTileArea;
+  int32 lastZ = 0;
+  uint32 requestCount = 0;
+  uint32 nextRevision = 0;
+  // Bumped by every source edit, only touched on the loader thread.
+  uint32 sourceVersion = 0;
+
+  // Shared with the loader thread.
+  mutable std::mutex loadedMutex;
+  std::vector<LoadedChunk> loadedChunks;
+  std::vector<ChangeBatch> changeBatches;
+  std::vector<std::unique_ptr<TileChunk>> freeChunks;
+
+  // Declared last so it is joined before anything it touches goes away.
+  ThreadPool loader{1};
+
+
+  static_assert(chunkSize == 32, "solidRows packs a chunk row into one uint32");
+
+  static void buildSolidRows(const TileChunk& chunk, uint32* solidRows)
+  {
+    for(int32 y = 0; y < chunkSize; y++)
+    {
+      const uint8* row = chunk.row(y);
+      uint32 bits = 0;
+      for(int32 x = 0; x < chunkSize; x++) bits |= (uint32)(row[x] == TT_WALL) << x;
+      solidRows[y] = bits;
+    }
+  }
+
+  // Bits firstX to lastX inclusive, both within a chunk row.
+  static uint32 getRowMask(int32 firstX, int32 lastX)
+  {
+    return (0xFFFFFFFFu >> (chunkSize - 1 - (lastX - firstX))) << firstX;
+  }
+
+  static sf::IntRect growRect(const sf::IntRect& rect, int32 amount)
+  {
+    return sf::IntRect(rect.left - amount, rect.top - amount, rect.width + amount * 2, rect.height + amount * 2);
+  }
+
+  void requestChunk(int32 chunkX, int32 chunkY, int32 z, bool urgent)
+  {
+    requestCount++;
+    std::function<void()> task = [this, chunkX, chunkY, z] {
+      std::unique_ptr<TileChunk> scratch;
+      {
+	std::lock_guard<std::mutex> lock(loadedMutex);
+	if(!freeChunks.empty()) { scratch = std::move(freeChunks.back()); freeChunks.pop_back(); }
+      }
+      if(!scratch) scratch.reset(new TileChunk);
+
+      LoadedChunk loaded = {chunkX, chunkY, z, source->loadChunk(chunkX, chunkY, z, *scratch), nullptr, sourceVersion};
+      if(loaded.tiles == scratch.get()) loaded.owned = std::move(scratch);
+
+      std::lock_guard<std::mutex> lock(loadedMutex);
+      if(scratch) freeChunks.push_back(std::move(scratch));
+      loadedChunks.push_back(std::move(loaded));
+    };
+    if(urgent) loader.pushFront(std::move(task));
+    else       loader.push(std::move(task));
+  }
+
+  void releaseChunk(ResidentChunk& chunk)
+  {
+    if(!chunk.owned) return;
+    std::lock_guard<std::mutex> lock(loadedMutex);
+    freeChunks.push_back(std::move(chunk.owned));
+  }
+
+  std::unique_ptr<TileChunk> allocateChunk()
+  {
+    std::lock_guard<std::mutex> lock(loadedMutex);
+    if(freeChunks.empty()) return std::unique_ptr<TileChunk>(new TileChunk);
+    std::unique_ptr<TileChunk> chunk = std::move(freeChunks.back());
+    freeChunks.pop_back();
+    return chunk;
+  }
+
+  // Patches resident chunks in place, copying chunks borrowed from the source first. Chunks that
+  // aren't resident but were asked for are asked for again, they may have been void before the
+  // edit or may still be on their way with the old tiles.
+  void applyChangeBatch(const ChangeBatch& batch)
+  {
+    std::set<std::pair<int32, uint64>> touchedChunks;
+    for(const TileChange& change : batch.changes)
+    {
+      Floor& floor = floors[change.z];
+      int32 chunkX = change.x >> chunkShift;
+      int32 chunkY = change.y >> chunkShift;
+      uint64 key = getChunkKey(chunkX, chunkY);
+      bool firstTouch = touchedChunks.insert(std::make_pair(change.z, key)).second;
+      if(firstTouch) floor.editedChunks[key] = batch.sourceVersion;
+
+      ChunkMap::iterator it = floor.chunks.find(key);
+      if(it == floor.chunks.end())
+      {
+	if(firstTouch && floor.requestedChunks.contains(chunkX, chunkY)) requestChunk(chunkX, chunkY, change.z, false);
+	continue;
+      }
+
+      ResidentChunk& resident = it->second;
+      if(!resident.owned)
+      {
+	resident.owned = allocateChunk();
+	*resident.owned = *resident.tiles;
+	resident.tiles = resident.owned.get();
+      }
+      int32 localX = change.x & chunkMask;
+      int32 localY = change.y & chunkMask;
+      resident.owned->row(localY)[localX] = change.tileType;
+      resident.revision = ++nextRevision;
+      if(change.tileType == TT_WALL) resident.solidRows[localY] |=  (1u << localX);
+      else                           resident.solidRows[localY] &= ~(1u << localX);
+      resident.hasStaircaseUp   = resident.hasStaircaseUp   || change.tileType == TT_STAIRCASE_UP;
+      resident.hasStaircaseDown = resident.hasStaircaseDown || change.tileType == TT_STAIRCASE_DOWN;
+    }
+  }
+
+  void takeLoadedChunks()
+  {
+    std::vector<LoadedChunk> loaded;
+    std::vector<ChangeBatch> batches;
+    {
+      std::lock_guard<std::mutex> lock(loadedMutex);
+      loaded.swap(loadedChunks);
+      batches.swap(changeBatches);
+    }
+
+    for(const ChangeBatch& batch : batches) applyChangeBatch(batch);
+
+    for(LoadedChunk& chunk : loaded)
+    {
+      Floor& floor = floors[chunk.z];
+      uint64 key = getChunkKey(chunk.chunkX, chunk.chunkY);
+      std::unordered_map<uint64, uint32>::const_iterator edited = floor.editedChunks.find(key);
+      bool stale = edited != floor.editedChunks.end() && chunk.sourceVersion < edited->second;
+      // Void chunks, chunks the player walked away from in the meantime, loads from before an edit
+      // and duplicates are dropped.
+      bool wanted = chunk.tiles && !stale && growRect(floor.wantedChunks, 1).contains(chunk.chunkX, chunk.chunkY) && !floor.chunks.count(key);
+      if(!wanted)
+      {
+	if(chunk.owned)
+	{
+	  std::lock_guard<std::mutex> lock(loadedMutex);
+	  freeChunks.push_back(std::move(chunk.owned));
+	}
+	continue;
+      }
+
+      ResidentChunk& resident = floor.chunks[key];
+      resident.tiles = chunk.tiles;
+      resident.owned = std::move(chunk.owned);
+      resident.revision = ++nextRevision;
+      buildSolidRows(*chunk.tiles, resident.solidRows);
+      resident.hasStaircaseUp   = std::find(chunk.tiles->tiles, chunk.tiles->tiles + chunkSize * chunkSize, (uint8)TT_STAIRCASE_UP)   != chunk.tiles->tiles + chunkSize * chunkSize;
+      resident.hasStaircaseDown = std::find(chunk.tiles->tiles, chunk.tiles->tiles + chunkSize * chunkSize, (uint8)TT_STAIRCASE_DOWN) != chunk.tiles->tiles + chunkSize * chunkSize;
+    }
+  }
+
+  // Without request the floor only drops what is out of range, that's for floors next to the
+  // player's floor that aren't wanted, they are kept around in case the player turns back.
+  void updateFloor(int32 z, const sf::IntRect& wantedChunks, bool request, bool urgent)
+  {
+    Floor& floor = floors[z];
+    floor.wantedChunks = wantedChunks;
+
+    // Chunks are only dropped once they are more than a chunk away from what is wanted,
+    // so walking along a chunk border doesn't reload them.
+    sf::IntRect keptChunks = growRect(wantedChunks, 1);
+    for(ChunkMap::iterator it = floor.chunks.begin(); it != floor.chunks.end();)
+    {
+      if(wantedChunks.width == 0 || !keptChunks.contains(getChunkCoordinates(it->first)))
+      {
+	releaseChunk(it->second);
+	it = floor.chunks.erase(it);
+      }
+      else ++it;
+    }
+
+    if(!request)
+    {
+      floor.requestedChunks = sf::IntRect();
+      return;
+    }
+
+    for(int32 chunkY = wantedChunks.top; chunkY < wantedChunks.top + wantedChunks.height; chunkY++)
+      for(int32 chunkX = wantedChunks.left; chunkX < wantedChunks.left + wantedChunks.width; chunkX++)
+      {
+	if(floor.requestedChunks.contains(chunkX, chunkY) || floor.chunks.count(getChunkKey(chunkX, chunkY))) continue;
+	requestChunk(chunkX, chunkY, z, urgent);
+      }
+    floor.requestedChunks = wantedChunks;
+  }
+public:
+  void setSource(std::unique_ptr<ChunkSource> newSource)
+  {
+    loader.wait();
+    takeLoadedChunks();
+    floors.clear();
+
+    source = std::move(newSource);
+    size = source->getSize();
+    floors.resize(size.z);
+  }
+
+  sf::Vector3i getSize() const { return size; }
+
+  // Runs edit on the loader thread ahead of any queued loads, so it has the source to itself.
+  // The tiles it returns as changed are patched into the resident chunks by the next
+  // updateResidency. Can be called from any thread.
+  void editSource(std::function<std::vector<TileChange>()> edit)
+  {
+    loader.pushFront([this, edit] {
+      std::vector<TileChange> changes = edit();
+      if(changes.empty()) return;
+
+      sourceVersion++;
+      std::lock_guard<std::mutex> lock(loadedMutex);
+      changeBatches.push_back({sourceVersion, std::move(changes)});
+    });
+  }
+
+  bool contains(int32 x, int32 y, int32 z) const
+  {
+    return x >= 0 && y >= 0 && z >= 0 && x < size.x && y < size.y && z < size.z;
+  }
+
+  // 0 for chunks that aren't resident.
+  uint32 getChunkRevision(int32 chunkX, int32 chunkY, int32 z) const
+  {
+    const ChunkMap& chunks = floors[z].chunks;
+    ChunkMap::const_iterator it = chunks.find(getChunkKey(chunkX, chunkY));
+    return it != chunks.end() ? it->second.revision : 0;
+  }
+
+  const TileChunk* getChunk(int32 chunkX, int32 chunkY, int32 z) const
+  {
+    const ChunkMap& chunks = floors[z].chunks;
+    ChunkMap::const_iterator it = chunks.find(getChunkKey(chunkX, chunkY));
+    return it != chunks.end() ? it->second.tiles : nullptr;
+  }
+
+  // Wall bits of a chunk, see ResidentChunk::solidRows, null for chunks that aren't resident.
+  const uint32* getSolidRows(int32 chunkX, int32 chunkY, int32 z) const
+  {
+    const ChunkMap& chunks = floors[z].chunks;
+    ChunkMap::const_iterator it = chunks.find(getChunkKey(chunkX, chunkY));
+    return it != chunks.end() ? it->second.solidRows : nullptr;
+  }
+
+  // Walls outside of the world, void in chunks that are empty or not resident.
+  TILE_TYPE getTile(int32 x, int32 y, int32 z) const
+  {
+    if(!contains(x, y, z)) return TT_WALL;
+    const TileChunk* chunk = getChunk(x >> chunkShift, y >> chunkShift, z);
+    if(!chunk) return TT_VOID;
+    return (TILE_TYPE)chunk->row(y & chunkMask)[x & chunkMask];
+  }
+
+  // Same answer as getTile(x, y, z) == TT_WALL, from the solid bits.
+  bool isSolid(int32 x, int32 y, int32 z) const
+  {
+    if(!contains(x, y, z)) return true;
+    const ChunkMap& chunks = floors[z].chunks;
+    ChunkMap::const_iterator it = chunks.find(getChunkKey(x >> chunkShift, y >> chunkShift));
+    if(it == chunks.end()) return false;
+    return (it->second.solidRows[y & chunkMask] >> (x & chunkMask) & 1) != 0;
+  }
+
+  // Whether any tile in tileRect is a wall, anything reaching outside of the world is. Every chunk
+  // the rect overlaps is looked up once and then tested a row at a time with one mask.
+  bool isAnySolid(const sf::IntRect& tileRect, int32 z) const
+  {
+    if(tileRect.width <= 0 || tileRect.height <= 0) return false;
+    int32 lastX = tileRect.left + tileRect.width  - 1;
+    int32 lastY = tileRect.top  + tileRect.height - 1;
+    if(!contains(tileRect.left, tileRect.top, z) || !contains(lastX, lastY, z)) return true;
+
+    const ChunkMap& chunks = floors[z].chunks;
+    sf::IntRect chunkRect = getChunkRect(tileRect);
+    for(int32 chunkY = chunkRect.top; chunkY < chunkRect.top + chunkRect.height; chunkY++)
+      for(int32 chunkX = chunkRect.left; chunkX < chunkRect.left + chunkRect.width; chunkX++)
+      {
+	ChunkMap::const_iterator it = chunks.find(getChunkKey(chunkX, chunkY));
+	if(it == chunks.end()) continue;
+
+	int32 chunkLeft = chunkX << chunkShift;
+	int32 chunkTop  = chunkY << chunkShift;
+	uint32 mask = getRowMask(std::max(tileRect.left, chunkLeft) - chunkLeft, std::min(lastX, chunkLeft + chunkMask) - chunkLeft);
+	int32 firstRow = std::max(tileRect.top, chunkTop) - chunkTop;
+	int32 lastRow  = std::min(lastY, chunkTop + chunkMask) - chunkTop;
+
+	const uint32* solidRows = it->second.solidRows;
+	uint32 hits = 0;
+	for(int32 y = firstRow; y <= lastRow; y++) hits |= solidRows[y] & mask;
+	if(hits != 0) return true;
+      }
+    return false;
+  }
+
+  // Wants every chunk overlapping tileArea on currentZ and on the floors that staircases inside
+  // tileArea lead to. Staircases down go to z + 1, staircases up to z - 1.
+  void updateResidency(const sf::IntRect& tileArea, int32 currentZ)
+  {
+    takeLoadedChunks();
+    lastTileArea = tileArea;
+    lastZ = currentZ;
+    if(size.z == 0) return;
+    currentZ = std::min(std::max(currentZ, (int32)0), size.z - 1);
+
+    sf::IntRect worldTiles(0, 0, size.x, size.y);
+    sf::IntRect clampedArea;
+    worldTiles.intersects(tileArea, clampedArea);
+    sf::IntRect wantedChunks = getChunkRect(clampedArea);
+
+    bool wantUp = false, wantDown = false;
+    for(const ChunkMap::value_type& entry : floors[currentZ].chunks)
+    {
+      if(!wantedChunks.contains(getChunkCoordinates(entry.first))) continue;
+      wantUp   = wantUp   || entry.second.hasStaircaseUp;
+      wantDown = wantDown || entry.second.hasStaircaseDown;
+    }
+
+    for(int32 z = 0; z < size.z; z++)
+    {
+      bool wanted = z == currentZ || (wantUp && z == currentZ - 1) || (wantDown && z == currentZ + 1);
+      if(wanted) updateFloor(z, wantedChunks, true, z == currentZ);
+      else if(std::abs(z - currentZ) > 1) updateFloor(z, sf::IntRect(), false, false);
+      else updateFloor(z, wantedChunks, false, false);
+    }
+  }
+
+  // Blocks until everything the last updateResidency wants is resident, for startup and tests.
+  // Floors behind staircases are only asked for once the chunk with the staircase is in,
+  // so this goes around until nothing new gets requested.
+  void finishLoading()
+  {
+    uint32 lastRequestCount;
+    do
+    {
+      lastRequestCount = requestCount;
+      loader.wait();
+      updateResidency(lastTileArea, lastZ);
+    } while(requestCount != lastRequestCount);
+  }
+
+  // Every chunk that may be resident on floor z, empty if none are.
+  sf::IntRect getResidentChunkRect(int32 z) const
+  {
+    const Floor& floor = floors[z];
+    if(floor.chunks.empty()) return sf::IntRect();
+    return growRect(floor.wantedChunks, 1);
+  }
+
+  size_t getResidentChunkCount() const
+  {
+    size_t count = 0;
+    for(const Floor& floor : floors) count += floor.chunks.size();
+    return count;
+  }
+
+  // Heap taken by chunks, chunks borrowed from the source aren't counted.
+  size_t getResidentBytes() const
+  {
+    size_t ownedCount = 0;
+    {
+      std::lock_guard<std::mutex> lock(loadedMutex);
+      ownedCount = freeChunks.size();
+    }
+    for(const Floor& floor : floors)
+      for(const ChunkMap::value_type& entry : floor.chunks)
+	if(entry.second.owned) ownedCount++;
+    return ownedCount * sizeof(TileChunk);
+  }
+};
+
+enum WALL_SIDE {
+  WS_TOP,
+  WS_RIGHT,
+  WS_BOTTOM,
+  WS_LEFT
+};
+
+// timeT is 1 when nothing was hit, ws is the side of the wall that was run into.
+struct CollisionResult {
+  f32 timeT;
+  sf::Vector2f collisionPoint;
+  WALL_SIDE ws;
+};
+
+// One side of a run of wall tiles, ws is the side of the walls it is on.
+struct WallSegment {
+  sf::Vector2f start;
+  sf::Vector2f end;
+  WALL_SIDE ws;
+};
+
+// The outline of the walls of every resident chunk as segments, a side shared by consecutive wall
+// tiles along a row or column is one segment. Segments are stored with the chunk they are in and
+// stop at chunk borders, so the chunk grid doubles as the spatial index and a chunk is all that
+// has to be redone when its tiles change.
+//
+// A chunk's outline also depends on the tiles around it, so it is kept with the revisions of the
+// chunk and its four neighbours and extracted again once any of them moved on. Tiles of chunks
+// that aren't resident count as open. Tiles outside of the world count as walls, the way isSolid
+// has them, so the world's border gets no sides facing out of it.
+class WallEdgeIndex {
+private:
+  struct ChunkWalls {
+    // Chunk itself, then above, below, left and right, 0 for chunks that aren't resident.
+    uint32 revisions[5];
+    std::vector<WallSegment> segments;
+  };
+  typedef std::unordered_map<uint64, ChunkWalls> ChunkWallMap;
+
+  std::vector<ChunkWallMap> floors;
+  size_t segmentCount = 0;
+
+
+  // Adds a segment for every run of set bits in edges, along x when horizontal, along y otherwise.
+  // line is the coordinate across the run, offset where bit 0 is.
+  static void addRuns(uint32 edges, bool horizontal, f32 line, int32 offset, WALL_SIDE ws, std::vector<WallSegment>& segments)
+  {
+    int32 runStart = -1;
+    for(int32 bit = 0; bit <= chunkSize; bit++)
+    {
+      bool set = bit < chunkSize && (edges >> bit & 1) != 0;
+      if(set && runStart < 0) runStart = bit;
+      if(set || runStart < 0) continue;
+
+      f32 from = (f32)(offset + runStart);
+      f32 to   = (f32)(offset + bit);
+      WallSegment segment;
+      segment.start = horizontal ? sf::Vector2f(from, line) : sf::Vector2f(line, from);
+      segment.end   = horizontal ? sf::Vector2f(to, line)   : sf::Vector2f(line, to);
+      segment.ws    = ws;
+      segments.push_back(segment);
+      runStart = -1;
+    }
+  }
+
+  // Row y of a chunk as wall bits with the tiles outside of the world set, y may be a row of the
+  // chunk above or below. solid is null for chunks that aren't resident.
+  static uint32 getWallRow(const ChunkedWorld& world, const uint32* solid, int32 chunkX, int32 chunkY, int32 y)
+  {
+    int32 tileX = chunkX << chunkShift;
+    int32 tileY = (chunkY << chunkShift) + y;
+    if(tileX < 0 || tileY < 0 || tileY >= world.getSize().y) return 0xFFFFFFFFu;
+    int32 insideCount = world.getSize().x - tileX;
+    uint32 outside = insideCount <= 0 ? 0xFFFFFFFFu : (insideCount < chunkSize ? 0xFFFFFFFFu << insideCount : 0);
+    return (solid ? solid[y] : 0) | outside;
+  }
+
+  static void extractChunk(const ChunkedWorld& world, int32 chunkX, int32 chunkY, int32 z, std::vector<WallSegment>& segments)
+  {
+    segments.clear();
+    const uint32* solid = world.getSolidRows(chunkX, chunkY, z);
+    if(!solid) return;
+    const uint32* above = world.getSolidRows(chunkX, chunkY - 1, z);
+    const uint32* below = world.getSolidRows(chunkX, chunkY + 1, z);
+    const uint32* left  = world.getSolidRows(chunkX - 1, chunkY, z);
+    const uint32* right = world.getSolidRows(chunkX + 1, chunkY, z);
+
+    int32 tileX = chunkX << chunkShift;
+    int32 tileY = chunkY << chunkShift;
+
+    // Sides along rows first, a bit per tile in each row.
+    for(int32 y = 0; y < chunkSize; y++)
+    {
+      uint32 rowAbove = y > 0 ? getWallRow(world, solid, chunkX, chunkY, y - 1) : getWallRow(world, above, chunkX, chunkY - 1, chunkSize - 1);
+      uint32 rowBelow = y < chunkSize - 1 ? getWallRow(world, solid, chunkX, chunkY, y + 1) : getWallRow(world, below, chunkX, chunkY + 1, 0);
+      addRuns(solid[y] & ~rowAbove, true, (f32)(tileY + y),     tileX, WS_TOP,    segments);
+      addRuns(solid[y] & ~rowBelow, true, (f32)(tileY + y + 1), tileX, WS_BOTTOM, segments);
+    }
+
+    // Sides along columns, the left and right edge bits of every row gathered into one word per column.
+    uint32 leftEdges[chunkSize] = {}, rightEdges[chunkSize] = {};
+    for(int32 y = 0; y < chunkSize; y++)
+    {
+      uint32 row = getWallRow(world, solid, chunkX, chunkY, y);
+      uint32 leftOfRow  = (row << 1) | (getWallRow(world, left, chunkX - 1, chunkY, y) >> (chunkSize - 1));
+      uint32 rightOfRow = (row >> 1) | ((getWallRow(world, right, chunkX + 1, chunkY, y) & 1) << (chunkSize - 1));
+      uint32 leftBits  = solid[y] & ~leftOfRow;
+      uint32 rightBits = solid[y] & ~rightOfRow;
+      for(int32 x = 0; x < chunkSize; x++)
+      {
+	leftEdges[x]  |= (leftBits  >> x & 1) << y;
+	rightEdges[x] |= (rightBits >> x & 1) << y;
+      }
+    }
+    for(int32 x = 0; x < chunkSize; x++)
+    {
+      addRuns(leftEdges[x],  false, (f32)(tileX + x),     tileY, WS_LEFT,  segments);
+      addRuns(rightEdges[x], false, (f32)(tileX + x + 1), tileY, WS_RIGHT, segments);
+    }
+  }
+public:
+  void clear()
+  {
+    floors.clear();
+    segmentCount = 0;
+  }
+
+  // Extracts the chunks that came in or changed since the last update, and the ones around them,
+  // and forgets the ones that went away.
+  void update(const ChunkedWorld& world)
+  {
+    int32 floorCount = world.getSize().z;
+    if((int32)floors.size() != floorCount) floors.resize(floorCount);
+
+    for(int32 z = 0; z < floorCount; z++)
+    {
+      ChunkWallMap& chunks = floors[z];
+      sf::IntRect residentChunks = world.getResidentChunkRect(z);
+
+      for(ChunkWallMap::iterator it = chunks.begin(); it != chunks.end();)
+      {
+	sf::Vector2i chunk = getChunkCoordinates(it->first);
+	if(!residentChunks.contains(chunk) || world.getChunkRevision(chunk.x, chunk.y, z) == 0)
+	{
+	  segmentCount -= it->second.segments.size();
+	  it = chunks.erase(it);
+	}
+	else ++it;
+      }
+
+      for(int32 chunkY = residentChunks.top; chunkY < residentChunks.top + residentChunks.height; chunkY++)
+	for(int32 chunkX = residentChunks.left; chunkX < residentChunks.left + residentChunks.width; chunkX++)
+	{
+	  uint32 revision = world.getChunkRevision(chunkX, chunkY, z);
+	  if(revision == 0) continue;
+
+	  uint32 revisions[5] = {revision,
+				 world.getChunkRevision(chunkX, chunkY - 1, z), world.getChunkRevision(chunkX, chunkY + 1, z),
+				 world.getChunkRevision(chunkX - 1, chunkY, z), world.getChunkRevision(chunkX + 1, chunkY, z)};
+	  ChunkWalls& walls = chunks[getChunkKey(chunkX, chunkY)];
+	  if(memcmp(walls.revisions, revisions, sizeof(revisions)) == 0) continue;
+
+	  memcpy(walls.revisions, revisions, sizeof(revisions));
+	  segmentCount -= walls.segments.size();
+	  extractChunk(world, chunkX, chunkY, z, walls.segments);
+	  segmentCount += walls.segments.size();
+	}
+    }
+  }
+
+  // Segments of every chunk overlapping tileArea, so some may lie outside of it.
+  template<typename Function>
+  void forEachSegment(const sf::IntRect& tileArea, int32 z, Function function) const
+  {
+    if(z < 0 || z >= (int32)floors.size()) return;
+    const ChunkWallMap& chunks = floors[z];
+    sf::IntRect chunkRect = getChunkRect(tileArea);
+    for(int32 chunkY = chunkRect.top; chunkY < chunkRect.top + chunkRect.height; chunkY++)
+      for(int32 chunkX = chunkRect.left; chunkX < chunkRect.left + chunkRect.width; chunkX++)
+      {
+	ChunkWallMap::const_iterator it = chunks.find(getChunkKey(chunkX, chunkY));
+	if(it == chunks.end()) continue;
+	for(const WallSegment& segment : it->second.segments) function(segment);
+      }
+  }
+
+  size_t getSegmentCount() const { return segmentCount; }
+};
+
+// What the player sees, by recursive shadowcasting over the eight octants around them, and what
+// they have seen so far. Both are kept as a bit per tile, in 32x32 blocks matching the chunks.
+// Explored bits are kept per floor for good, even once the chunks they cover are evicted.
+//
+// Walls block sight and are seen themselves, void and chunks that aren't resident don't block it.
+class FieldOfView {
+private:
+  struct TileBits {
+    uint32 rows[chunkSize];
+    // Bumped whenever a bit is set that wasn't, only kept up for explored bits.
+    uint32 revision;
+  };
+  typedef std::unordered_map<uint64, TileBits> TileBitMap;
+
+  std::vector<TileBitMap> explored;
+  TileBitMap visible;
+  int32 visibleZ = -1;
+
+  // What the last compute saw, it is only done again once any of it changed.
+  sf::Vector3i lastTile;
+  int32 lastRadius = -1;
+  uint64 lastRevisions = 0;
+
+  // Block the last tile was set in, consecutive tiles are mostly in the same one.
+  uint64 lastKey = 0;
+  TileBits* lastVisible = nullptr;
+  TileBits* lastExplored = nullptr;
+
+
+  static const uint32* getRows(const TileBitMap& bits, int32 chunkX, int32 chunkY)
+  {
+    TileBitMap::const_iterator it = bits.find(getChunkKey(chunkX, chunkY));
+    return it != bits.end() ? it->second.rows : nullptr;
+  }
+
+  static TileBits& getOrAddBits(TileBitMap& bits, uint64 key)
+  {
+    std::pair<TileBitMap::iterator, bool> inserted = bits.insert(std::make_pair(key, TileBits()));
+    if(inserted.second) memset(&inserted.first->second, 0, sizeof(TileBits));
+    return inserted.first->second;
+  }
+
+  void see(int32 x, int32 y, int32 z)
+  {
+    uint64 key = getChunkKey(x >> chunkShift, y >> chunkShift);
+    if(!lastVisible || key != lastKey)
+    {
+      lastKey = key;
+      lastVisible  = &getOrAddBits(visible, key);
+      lastExplored = &getOrAddBits(explored[z], key);
+    }
+    uint32 bit = 1u << (x & chunkMask);
+    lastVisible->rows[y & chunkMask] |= bit;
+    if((lastExplored->rows[y & chunkMask] & bit) == 0)
+    {
+      lastExplored->rows[y & chunkMask] |= bit;
+      lastExplored->revision++;
+    }
+  }
+
+  // Scans one octant row by row from row outwards, between the slopes start and end. The octant is
+  // turned into place by the xx, xy, yx, yy multipliers. Every wall that starts a shadow narrows the
+  // rest of the scan, the part past the wall is scanned further out by a recursive call.
+  void castLight(const ChunkedWorld& world, sf::Vector3i origin, int32 radius, int32 row, f32 start, f32 end,
+		 int32 xx, int32 xy, int32 yx, int32 yy)
+  {
+    if(start < end) return;
+    int32 radiusSquared = radius * radius;
+    f32 newStart = 0.0f;
+
+    for(int32 distance = row; distance <= radius; distance++)
+    {
+      int32 deltaY = -distance;
+      bool blocked = false;
+      for(int32 deltaX = -distance; deltaX <= 0; deltaX++)
+      {
+	f32 leftSlope  = ((f32)deltaX - 0.5f) / ((f32)deltaY + 0.5f);
+	f32 rightSlope = ((f32)deltaX + 0.5f) / ((f32)deltaY - 0.5f);
+	if(start < rightSlope) continue;
+	if(end > leftSlope) break;
+
+	int32 x = origin.x + deltaX * xx + deltaY * xy;
+	int32 y = origin.y + deltaX * yx + deltaY * yy;
+	bool opaque = world.isSolid(x, y, origin.z);
+	if(deltaX * deltaX + deltaY * deltaY <= radiusSquared && world.contains(x, y, origin.z)) see(x, y, origin.z);
+
+	if(blocked)
+	{
+	  if(opaque) newStart = rightSlope;
+	  else
+	  {
+	    blocked = false;
+	    start = newStart;
+	  }
+	}
+	else if(opaque && distance < radius)
+	{
+	  blocked = true;
+	  castLight(world, origin, radius, distance + 1, start, leftSlope, xx, xy, yx, yy);
+	  newStart = rightSlope;
+	}
+      }
+      if(blocked) break;
+    }
+  }
+
+  // Folds the revisions of every chunk in reach into one number, so any chunk coming, going or
+  // changing shows.
+  static uint64 getRevisions(const ChunkedWorld& world, sf::Vector3i tile, int32 radius)
+  {
+    sf::IntRect chunks = getChunkRect(sf::IntRect(tile.x - radius, tile.y - radius, radius * 2 + 1, radius * 2 + 1));
+    uint64 revisions = 0;
+    for(int32 chunkY = chunks.top; chunkY < chunks.top + chunks.height; chunkY++)
+      for(int32 chunkX = chunks.left; chunkX < chunks.left + chunks.width; chunkX++)
+	revisions = revisions * 31 + world.getChunkRevision(chunkX, chunkY, tile.z);
+    return revisions;
+  }
+public:
+  void clear()
+  {
+    explored.clear();
+    visible.clear();
+    visibleZ = -1;
+    lastRadius = -1;
+    lastVisible = lastExplored = nullptr;
+  }
+
+  // Computes what can be seen from the middle of tile, up to radius tiles away.
+  void compute(const ChunkedWorld& world, sf::Vector3i tile, int32 radius)
+  {
+    sf::Vector3i size = world.getSize();
+    if((int32)explored.size() != size.z) explored.resize(size.z);
+    // Blocks of the last compute are cleared and reused, unless the player went to another floor
+    // or they piled up from walking far.
+    if(tile.z != visibleZ || visible.size() > 64) visible.clear();
+    else for(TileBitMap::value_type& entry : visible) memset(entry.second.rows, 0, sizeof(entry.second.rows));
+    visibleZ = tile.z;
+    lastVisible = lastExplored = nullptr;
+    if(tile.z < 0 || tile.z >= size.z) return;
+
+    if(world.contains(tile.x, tile.y, tile.z)) see(tile.x, tile.y, tile.z);
+    const int32 octants[8][4] = {{1, 0, 0, 1}, {0, 1, 1, 0}, {0, -1, 1, 0}, {-1, 0, 0, 1},
+				 {-1, 0, 0, -1}, {0, -1, -1, 0}, {0, 1, -1, 0}, {1, 0, 0, -1}};
+    for(const int32* octant : octants)
+      castLight(world, tile, radius, 1, 1.0f, 0.0f, octant[0], octant[1], octant[2], octant[3]);
+  }
+
+  // Computes again if the player moved onto another tile or any chunk in reach changed,
+  // returns whether it did.
+  bool update(const ChunkedWorld& world, sf::Vector3i tile, int32 radius)
+  {
+    uint64 revisions = getRevisions(world, tile, radius);
+    if(tile == lastTile && radius == lastRadius && revisions == lastRevisions) return false;
+
+    lastTile = tile;
+    lastRadius = radius;
+    lastRevisions = revisions;
+    compute(world, tile, radius);
+    return true;
+  }
+
+  bool isVisible(int32 x, int32 y, int32 z) const
+  {
+    if(z != visibleZ) return false;
+    const uint32* rows = getRows(visible, x >> chunkShift, y >> chunkShift);
+    return rows && (rows[y & chunkMask] >> (x & chunkMask) & 1) != 0;
+  }
+
+  bool isExplored(int32 x, int32 y, int32 z) const
+  {
+    const uint32* rows = getExploredRows(x >> chunkShift, y >> chunkShift, z);
+    return rows && (rows[y & chunkMask] >> (x & chunkMask) & 1) != 0;
+  }
+
+  // Changes whenever more of a chunk gets explored, 0 if none of it was seen.
+  uint32 getExploredRevision(int32 chunkX, int32 chunkY, int32 z) const
+  {
+    if(z < 0 || z >= (int32)explored.size()) return 0;
+    TileBitMap::const_iterator it = explored[z].find(getChunkKey(chunkX, chunkY));
+    return it != explored[z].end() ? it->second.revision : 0;
+  }
+
+  // Explored bits of a chunk, a bit per tile like ResidentChunk::solidRows, null if none of it was seen.
+  const uint32* getExploredRows(int32 chunkX, int32 chunkY, int32 z) const
+  {
+    if(z < 0 || z >= (int32)explored.size()) return nullptr;
+    return getRows(explored[z], chunkX, chunkY);
+  }
+};
+
+// direction doesn't need to be normalized, maxDistance is in tiles.
+struct Ray {
+  sf::Vector2f origin;
+  sf::Vector2f direction;
+  f32 maxDistance;
+};
+
+// distance is in tiles from the ray origin to where it enters the tile, ws the side it enters
+// through. A ray starting inside a wall hits it at distance 0.
+struct RaycastHit {
+  bool hit;
+  sf::Vector2i tile;
+  f32 distance;
+  WALL_SIDE ws;
+};
+
+// How far, in tiles, a rect may overlap a wall and still count as only touching it. Covers the
+// rounding left after moving a rect right up to a wall, without it a rect sliding along a wall
+// would catch on every tile border.
+const f32 collisionSkin = 1.0f / 1024.0f;
+
+// Times at which [boxMin, boxMax] moving by delta starts and stops overlapping the tile starting
+// at tileMin. False if it never overlaps, standing still only overlaps by more than the skin.
+bool getSweptOverlap(f32 boxMin, f32 boxMax, f32 delta, f32 tileMin, f32& entry, f32& exit)
+{
+  f32 tileMax = tileMin + 1.0f;
+  if(delta == 0.0f)
+  {
+    if(boxMax - collisionSkin <= tileMin || boxMin + collisionSkin >= tileMax) return false;
+    entry = -std::numeric_limits<f32>::max();
+    exit  =  std::numeric_limits<f32>::max();
+  }
+  else if(delta > 0.0f)
+  {
+    entry = (tileMin - boxMax) / delta;
+    exit  = (tileMax - boxMin) / delta;
+  }
+  else
+  {
+    entry = (tileMax - boxMin) / delta;
+    exit  = (tileMin - boxMax) / delta;
+  }
+  return true;
+}
+
+struct RenderStats {
+  uint32 drawCalls;
+  uint32 tilesDrawn;
+};
+
+sf::Color getTileColor(TILE_TYPE tileType)
+{
+  switch(tileType)
+  {
+  case TT_WALL :            return sf::Color::Black;
+  case TT_FLOOR :           return sf::Color::White;
+  case TT_STAIRCASE_UP :    return staircaseUpColor;
+  case TT_STAIRCASE_DOWN :  return staircaseDownColor;
+  default :                 return sf::Color::Transparent;
+  }
+}
+
+// Pixels in RGBA order, drawn by the Renderer that made it.
+class RenderImage {
+public:
+  virtual ~RenderImage() {}
+
+  virtual void update(const uint8* pixels) = 0;
+};
+
+// What Level and Player draw through, so the same frame can go to a window or into memory.
+// Positions are in pixels.
+class Renderer {
+public:
+  virtual ~Renderer() {}
+
+  virtual sf::Vector2u getSize() const = 0;
+  virtual void clear(sf::Color color) = 0;
+  virtual void fillRect(const sf::FloatRect& rect, sf::Color color) = 0;
+  virtual std::unique_ptr<RenderImage> createImage(sf::Vector2u size) = 0;
+  // Stretches image over rect without filtering, every texel turns into a block of pixels.
+  virtual void drawImage(const RenderImage& image, const sf::FloatRect& rect) = 0;
+};
+
+class SfmlRenderer : public Renderer {
+private:
+  class TextureImage : public RenderImage {
+  public:
+    sf::Texture texture;
+
+    void update(const uint8* pixels) override { texture.update(pixels); }
+  };
+
+  sf::RenderTarget& target;
+public:
+  explicit SfmlRenderer(sf::RenderTarget& target) : target(target) {}
+
+  sf::Vector2u getSize() const override { return target.getSize(); }
+  void clear(sf::Color color) override { target.clear(color); }
+
+  void fillRect(const sf::FloatRect& rect, sf::Color color) override
+  {
+    sf::Vertex quad[4] = {
+      sf::Vertex(sf::Vector2f(rect.left, rect.top), color),
+      sf::Vertex(sf::Vector2f(rect.left + rect.width, rect.top), color),
+      sf::Vertex(sf::Vector2f(rect.left + rect.width, rect.top + rect.height), color),
+      sf::Vertex(sf::Vector2f(rect.left, rect.top + rect.height), color)
+    };
+    target.draw(quad, 4, sf::Quads);
+  }
+
+  std::unique_ptr<RenderImage> createImage(sf::Vector2u size) override
+  {
+    TextureImage* image = new TextureImage;
+    image->texture.create(size.x, size.y);
+    return std::unique_ptr<RenderImage>(image);
+  }
+
+  void drawImage(const RenderImage& image, const sf::FloatRect& rect) override
+  {
+    const sf::Texture& texture = static_cast<const TextureImage&>(image).texture;
+    sf::Vector2f textureSize((f32)texture.getSize().x, (f32)texture.getSize().y);
+    sf::Vertex quad[4] = {
+      sf::Vertex(sf::Vector2f(rect.left, rect.top), sf::Vector2f(0.0f, 0.0f)),
+      sf::Vertex(sf::Vector2f(rect.left + rect.width, rect.top), sf::Vector2f(textureSize.x, 0.0f)),
+      sf::Vertex(sf::Vector2f(rect.left + rect.width, rect.top + rect.height), textureSize),
+      sf::Vertex(sf::Vector2f(rect.left, rect.top + rect.height), sf::Vector2f(0.0f, textureSize.y))
+    };
+    target.draw(quad, 4, sf::Quads, sf::RenderStates(&texture));
+  }
+};
+
+// Rasterizes into an RGBA framebuffer in memory, for machines without a GPU or a display. Follows
+// the same rule as the GPU: a pixel is covered when its center is inside the rect.
+class CpuRenderer : public Renderer {
+private:
+  class PixelImage : public RenderImage {
+  public:
+    sf::Vector2u size;
+    std::vector<uint8> pixels;
+
+    void update(const uint8* newPixels) override { memcpy(pixels.data(), newPixels, pixels.size()); }
+  };
+
+  sf::Vector2u size;
+  std::vector<uint8> pixels;
+  // Texel column of every pixel column drawImage covers, kept to save the allocation.
+  std::vector<uint32> texelColumns;
+
+  // Pixels from first up to end have their centers in [from, to), clamped to the framebuffer.
+  static void getPixelSpan(f32 from, f32 to, uint32 limit, int32& first, int32& end)
+  {
+    first = std::max((int32)std::ceil(from - 0.5f), (int32)0);
+    end   = std::min((int32)std::ceil(to - 0.5f), (int32)limit);
+  }
+
+  static void blend(uint8* destination, const uint8* source)
+  {
+    uint32 alpha = source[3];
+    if(alpha == 255) { memcpy(destination, source, 4); return; }
+    if(alpha == 0) return;
+    for(uint32 channel = 0; channel < 3; channel++)
+      destination[channel] = (uint8)((source[channel] * alpha + destination[channel] * (255 - alpha) + 127) / 255);
+    destination[3] = (uint8)(alpha + (destination[3] * (255 - alpha) + 127) / 255);
+  }
+public:
+  explicit CpuRenderer(sf::Vector2u size) : size(size), pixels((size_t)size.x * size.y * 4) {}
+
+  sf::Vector2u getSize() const override { return size; }
+
+  void clear(sf::Color color) override
+  {
+    uint8 pixel[4] = {color.r, color.g, color.b, color.a};
+    for(size_t i = 0; i < pixels.size(); i += 4) memcpy(&pixels[i], pixel, 4);
+  }
+
+  void fillRect(const sf::FloatRect& rect, sf::Color color) override
+  {
+    int32 firstX, endX, firstY, endY;
+    getPixelSpan(rect.left, rect.left + rect.width,  size.x, firstX, endX);
+    getPixelSpan(rect.top,  rect.top  + rect.height, size.y, firstY, endY);
+    uint8 pixel[4] = {color.r, color.g, color.b, color.a};
+    for(int32 y = firstY; y < endY; y++)
+      for(int32 x = firstX; x < endX; x++) blend(&pixels[((size_t)y * size.x + x) * 4], pixel);
+  }
+
+  std::unique_ptr<RenderImage> createImage(sf::Vector2u imageSize) override
+  {
+    PixelImage* image = new PixelImage;
+    image->size = imageSize;
+    image->pixels.resize((size_t)imageSize.x * imageSize.y * 4);
+    return std::unique_ptr<RenderImage>(image);
+  }
+
+  void drawImage(const RenderImage& renderImage, const sf::FloatRect& rect) override
+  {
+    const PixelImage& image = static_cast<const PixelImage&>(renderImage);
+    int32 firstX, endX, firstY, endY;
+    getPixelSpan(rect.left, rect.left + rect.width,  size.x, firstX, endX);
+    getPixelSpan(rect.top,  rect.top  + rect.height, size.y, firstY, endY);
+    if(firstX >= endX || firstY >= endY) return;
+
+    // Texel under the center of each pixel, worked out once per column and once per row.
+    f32 texelsPerPixelX = (f32)image.size.x / rect.width;
+    f32 texelsPerPixelY = (f32)image.size.y / rect.height;
+    texelColumns.resize(endX - firstX);
+    for(int32 x = firstX; x < endX; x++)
+      texelColumns[x - firstX] = std::min((uint32)(((f32)x + 0.5f - rect.left) * texelsPerPixelX), image.size.x - 1);
+
+    for(int32 y = firstY; y < endY; y++)
+    {
+      uint32 texelY = std::min((uint32)(((f32)y + 0.5f - rect.top) * texelsPerPixelY), image.size.y - 1);
+      const uint8* texelRow = &image.pixels[(size_t)texelY * image.size.x * 4];
+      uint8* row = &pixels[((size_t)y * size.x + firstX) * 4];
+      for(int32 x = 0; x < endX - firstX; x++) blend(row + x * 4, texelRow + texelColumns[x] * 4);
+    }
+  }
+
+  const uint8* getPixels() const { return pixels.data(); }
+
+  bool saveToFile(const std::string& filename) const
+  {
+    sf::Image image;
+    image.create(size.x, size.y, pixels.data());
+    return image.saveToFile(filename);
+  }
+};
+
+void appendTileQuad(sf::VertexArray& batch, sf::Vector2f position, f32 tileSize, sf::Color color)
+{
+  batch.append(sf::Vertex(position, color));
+  batch.append(sf::Vertex(sf::Vector2f(position.x + tileSize, position.y), color));
+  batch.append(sf::Vertex(sf::Vector2f(position.x + tileSize, position.y + tileSize), color));
+  batch.append(sf::Vertex(sf::Vector2f(position.x, position.y + tileSize), color));
+}
+
+// Tile x lands on screen at (x - cameraPosition.x - halfResInTiles.x) * tileSize, so only the tiles
+// from floor(cameraPosition.x + halfResInTiles.x) up to that plus the screen width can be visible.
+// Returned rect is clamped to the map, so it is empty when the camera looks past the map edges.
+sf::IntRect getVisibleTileRect(sf::Vector3f cameraPosition, sf::Vector2f halfResInTiles,
+			       sf::Vector2f resolutionInTiles, sf::Vector2u mapSize)
+{
+  f32 firstX = cameraPosition.x + halfResInTiles.x;
+  f32 firstY = cameraPosition.y + halfResInTiles.y;
+
+  int32 minX = std::max((int32)std::floor(firstX), (int32)0);
+  int32 minY = std::max((int32)std::floor(firstY), (int32)0);
+  int32 maxX = std::min((int32)std::ceil(firstX + resolutionInTiles.x), (int32)mapSize.x);
+  int32 maxY = std::min((int32)std::ceil(firstY + resolutionInTiles.y), (int32)mapSize.y);
+
+  return sf::IntRect(minX, minY, std::max(maxX - minX, (int32)0), std::max(maxY - minY, (int32)0));
+}
+
+// Colors of the floors a chunk shows from one floor down, a texel per tile, see Level::getChunkImage.
+// Never changed once made, so the render thread can keep drawing it while the simulation makes
+// the next one.
+struct ChunkImage {
+  // A new image gets a new id, even where an old one was freed.
+  uint64 id;
+  uint32 tileCount;
+  uint8 pixels[chunkSize * chunkSize * 4];
+};
+
+struct VisibleChunk {
+  sf::Vector2i chunk;
+  std::shared_ptr<const ChunkImage> image;
+};
+
+// Draws every chunk on screen as one quad scaled up to the tile size, with its image in a texture
+// left unfiltered. Tiles are flat colors, so that looks the same as drawing them one by one, and
+// zooming never has to update the textures. A texture is only updated when its chunk got a new
+// image. Holds nothing of the level, so it can draw on another thread than the one making images.
+class ChunkView {
+private:
+  struct ChunkTexture {
+    std::unique_ptr<RenderImage> texture;
+    uint64 imageId;
+    uint32 lastFrame;
+  };
+  typedef std::unordered_map<uint64, ChunkTexture> ChunkTextureMap;
+  ChunkTextureMap chunkTextures;
+  std::vector<std::unique_ptr<RenderImage>> spareTextures;
+  // Textures belong to the renderer that made them, they are all dropped when another one draws.
+  const Renderer* textureRenderer = nullptr;
+  uint32 frame = 0;
+
+  // Textures of chunks off screen for this many frames go back to the spares. Keeping them a
+  // while means walking along a chunk border doesn't update them over and over.
+  static const uint32 keptFrames = 60;
+public:
+  RenderStats render(Renderer& renderer, const std::vector<VisibleChunk>& chunks, f32 tileSize, sf::Vector3f cameraPosition)
+  {
+    RenderStats stats = {};
+    if(textureRenderer != &renderer)
+    {
+      chunkTextures.clear();
+      spareTextures.clear();
+      textureRenderer = &renderer;
+    }
+    frame++;
+
+    sf::Vector2u screenResolution  = renderer.getSize();
+    sf::Vector2f halfResInTiles    ((f32)screenResolution.x / tileSize / 2.0f, (f32)screenResolution.y / tileSize / 2.0f);
+    f32 chunkPixelSize = (f32)chunkSize * tileSize;
+    for(const VisibleChunk& visibleChunk : chunks)
+    {
+      ChunkTexture& chunkTexture = chunkTextures[getChunkKey(visibleChunk.chunk.x, visibleChunk.chunk.y)];
+      if(!chunkTexture.texture)
+      {
+	if(!spareTextures.empty())
+	{
+	  chunkTexture.texture = std::move(spareTextures.back());
+	  spareTextures.pop_back();
+	}
+	else chunkTexture.texture = renderer.createImage(sf::Vector2u(chunkSize, chunkSize));
+	chunkTexture.imageId = 0;
+      }
+      if(chunkTexture.imageId != visibleChunk.image->id)
+      {
+	chunkTexture.texture->update(visibleChunk.image->pixels);
+	chunkTexture.imageId = visibleChunk.image->id;
+      }
+      chunkTexture.lastFrame = frame;
+
+      sf::Vector2f position(((f32)(visibleChunk.chunk.x << chunkShift) - cameraPosition.x - halfResInTiles.x) * tileSize,
+			    ((f32)(visibleChunk.chunk.y << chunkShift) - cameraPosition.y - halfResInTiles.y) * tileSize);
+      renderer.drawImage(*chunkTexture.texture, sf::FloatRect(position, sf::Vector2f(chunkPixelSize, chunkPixelSize)));
+      stats.drawCalls++;
+      stats.tilesDrawn += visibleChunk.image->tileCount;
+    }
+
+    for(ChunkTextureMap::iterator it = chunkTextures.begin(); it != chunkTextures.end();)
+    {
+      if(frame - it->second.lastFrame <= keptFrames) { ++it; continue; }
+      spareTextures.push_back(std::move(it->second.texture));
+      it = chunkTextures.erase(it);
+    }
+    return stats;
+  }
+};
+
+const int32 fieldOfViewRadius = 30;
+
+class Level {
+private:
+  ChunkedWorld world;
+  WallEdgeIndex wallEdges;
+  FieldOfView fieldOfView;
+  // Draws unexplored tiles too, for benchmarks and looking around a map.
+  bool revealAll = false;
+
+  // A chunk image holds the whole stack of floors from the camera's floor down: each tile column
+  // takes its color from the first floor with something drawn in it, so no floor is painted
+  // over another and the cost doesn't grow with the number of floors.
+  struct CachedChunkImage {
+    // What the image was made from, the chunk and explored revisions of every floor from
+    // firstZ down. A new one is made once any of them moved on.
+    std::vector<uint32> revisions;
+    int32 firstZ;
+    bool revealAll;
+    std::shared_ptr<const ChunkImage> image;
+  };
+  typedef std::unordered_map<uint64, CachedChunkImage> ChunkImageMap;
+  ChunkImageMap chunkImages;
+  uint64 imageCount = 0;
+  std::vector<uint32> chunkRevisions;
+  std::vector<VisibleChunk> visibleChunks;
+  ChunkView chunkView;
+  sf::VertexArray tileBatch = sf::VertexArray(sf::Quads);
+
+  // Set when the level was imported from PNGs, the source itself is only touched on the loader thread.
+  GridChunkSource* importedTiles = nullptr;
+  std::vector<std::string> layerFilenames;
+  FileWatcher mapWatcher;
+  // Declared after world, so it is joined before the world goes away.
+  ThreadPool reloader{1};
+public:
+  bool loadFromFile(const std::string& baseFilename, uint32 levelCount)
+  {
+    Grid3D tiles;
+    std::vector<sf::Vector2u> layerSizes;
+    std::vector<std::string> filenames = getLayerFilenames(baseFilename, levelCount);
+    ThreadPool pool(std::min(levelCount, std::thread::hardware_concurrency()));
+    if(!importFromImages(filenames, pool, tiles, layerSizes)) return false;
+
+    reloader.wait();
+    std::unique_ptr<GridChunkSource> source = std::make_unique<GridChunkSource>(std::move(tiles));
+    importedTiles = source.get();
+    wallEdges.clear();
+    fieldOfView.clear();
+    chunkImages.clear();
+    world.setSource(std::move(source));
+
+    layerFilenames = filenames;
+    if(!mapWatcher.watch(layerFilenames)) LOG_WARNING("Level: map files can't be watched, hot reload is off");
+
+    if(levelCount > 0) return true;
+    else return false;
+  }
+
+  // Re-imports every map layer saved since the last call on the reload thread. Only the tiles
+  // that differ from what is loaded are swapped in, on the resident chunks they fall into.
+  void reloadChangedLayers()
+  {
+    if(!importedTiles) return;
+
+    for(size_t layerIndex : mapWatcher.poll())
+    {
+      std::string filename = layerFilenames[layerIndex];
+      int32 z = (int32)layerIndex;
+      GridChunkSource* source = importedTiles;
+      sf::Vector3i size = world.getSize();
+
+      reloader.push([this, filename, z, source, size] {
+	sf::Image image;
+	if(!image.loadFromFile(filename)) {
+	  LOG_ERROR("Level: " << filename << " couldn't be reloaded !");
+	  return;
+	}
+	if(image.getSize().x > (uint32)size.x || image.getSize().y > (uint32)size.y)
+	  LOG_WARNING("Level: " << filename << " grew past the level size, the rest is cut off");
+
+	std::shared_ptr<Grid3D> layer = std::make_shared<Grid3D>();
+	layer->resize((uint32)size.x, (uint32)size.y, 1);
+	size_t unknownCount = loadFromImage2D(image, layer->layer(0));
+
+	world.editSource([source, layer, z, filename, unknownCount] {
+	  std::vector<TileChange> changes = source->replaceLayer(z, layer->layer(0));
+	  if(unknownCount > 0)
+	    LOG_WARNING("Level: " << filename << " reloaded, " << changes.size() << " tiles changed, " << unknownCount << " pixels outside of the palette");
+	  else LOG_INFO("Level: " << filename << " reloaded, " << changes.size() << " tiles changed");
+	  return changes;
+	});
+      });
+    }
+  }
+
+  // Maps a level baked with -bake, tiles are read in place from the file.
+  bool loadFromLevelFile(const std::string& filename)
+  {
+    // Levels are only baked on request, so a missing file is left to the caller to fall back from.
+    if(getFileWriteTime(filename) == 0) return false;
+    std::unique_ptr<LevelFileChunkSource> source(new LevelFileChunkSource);
+    if(!source->open(filename)) {
+      LOG_ERROR("Level: " << filename << " couldn't be loaded !");
+      return false;
+    }
+
+    reloader.wait();
+    importedTiles = nullptr;
+    mapWatcher.stop();
+    wallEdges.clear();
+    fieldOfView.clear();
+    chunkImages.clear();
+    world.setSource(std::move(source));
+    return true;
+  }
+
+  static std::vector<std::string> getLayerFilenames(const std::string& baseFilename, uint32 levelCount)
+  {
+    std::vector<std::string> filenames(levelCount);
+    for(uint32 i = 0; i < levelCount; i++) filenames[i] = baseFilename + std::to_string(i+1) + ".png";
+    return filenames;
+  }
+
+  // Decodes one image per layer into tiles. Layers don't depend on each other, so decoding and
+  // classifying both run as one task per layer on the pool. Failures are reported in layer order.
+  static bool importFromImages(const std::vector<std::string>& filenames, ThreadPool& pool,
+			       Grid3D& tiles, std::vector<sf::Vector2u>& layerSizes)
+  {
+    uint32 levelCount = (uint32)filenames.size();
+    std::vector<sf::Image> images(levelCount);
+    std::vector<uint8> loaded(levelCount);
+
+    for(uint32 i = 0; i < levelCount; i++)
+      pool.push([&, i] { loaded[i] = images[i].loadFromFile(filenames[i]) && images[i].getSize().y > 0; });
+    pool.wait();
+
+    bool allLoaded = true;
+    sf::Vector2u levelSize;
+    layerSizes.resize(levelCount);
+    for(uint32 i = 0; i < levelCount; i++)
+    {
+      if(!loaded[i]) {
+	LOG_ERROR("Level: " << filenames[i] << " couldn't be loaded !");
+	allLoaded = false;
+	continue;
+      }
+      // Layers don't have to be the same size, smaller ones are padded with void.
+      levelSize.x = std::max(levelSize.x, images[i].getSize().x);
+      levelSize.y = std::max(levelSize.y, images[i].getSize().y);
+      layerSizes[i] = images[i].getSize();
+    }
+    if(!allLoaded) return false;
+
+    tiles.resize(levelSize.x, levelSize.y, levelCount);
+    std::vector<size_t> unknownCounts(levelCount);
+    for(uint32 i = 0; i < levelCount; i++)
+      pool.push([&, i] { unknownCounts[i] = loadFromImage2D(images[i], tiles.layer(i)); });
+    pool.wait();
+
+    for(uint32 i = 0; i < levelCount; i++)
+    {
+      if(unknownCounts[i] == 0) continue;
+      sf::Vector2u position = findUnknownPixel(images[i]);
+      sf::Color color = images[i].getPixel(position.x, position.y);
+      LOG_WARNING("Level: " << filenames[i] << " has " << unknownCounts[i] << " pixels with colors outside of the palette, " <<
+		  "loaded as void (first at " << position.x << ", " << position.y << ": " <<
+		  (int)color.r << ", " << (int)color.g << ", " << (int)color.b << ", " << (int)color.a << ")");
+    }
+    return true;
+  }
+
+  // Returns how many pixels had a color outside of the palette, those are loaded as void.
+  // Anything past the edges of the layer is left out.
+  static size_t loadFromImage2D(const sf::Image& image, GridLayer layer)
+  {
+    sf::Vector2u size = image.getSize();
+    const uint8* pixels = image.getPixelsPtr();
+    TilePalette palette = getTilePalette();
+    uint32 width  = std::min(size.x, layer.width);
+    uint32 height = std::min(size.y, layer.height);
+
+    size_t unknownCount = 0;
+    for(uint32 y = 0; y < height; y++)
+      unknownCount += classifyPixels(pixels + (size_t)y * size.x * 4, layer.row(y), width, palette);
+    return unknownCount;
+  }
+
+  // First pixel with a color outside of the palette, only used to make the import warning useful.
+  static sf::Vector2u findUnknownPixel(const sf::Image& image)
+  {
+    TilePalette palette = getTilePalette();
+    sf::Vector2u size = image.getSize();
+    for(uint32 y = 0; y < size.y; y++)
+      for(uint32 x = 0; x < size.x; x++)
+      {
+	uint8 tile;
+	if(classifyPixelsScalar(image.getPixelsPtr() + ((size_t)y * size.x + x) * 4, &tile, 1, palette)) return {x, y};
+      }
+    return size;
+  }
+
+  void setSource(std::unique_ptr<ChunkSource> source)
+  {
+    reloader.wait();
+    importedTiles = nullptr;
+    mapWatcher.stop();
+    wallEdges.clear();
+    fieldOfView.clear();
+    chunkImages.clear();
+    world.setSource(std::move(source));
+  }
+
+  const ChunkedWorld& getWorld() const { return world; }
+
+  sf::IntRect getVisibleTiles(sf::Vector2u screenResolution, f32 tileSize, sf::Vector3f cameraPosition) const
+  {
+    sf::Vector2f resolutionInTiles ((f32)screenResolution.x / tileSize, (f32)screenResolution.y / tileSize);
+    sf::Vector2f halfResInTiles    (resolutionInTiles.x / 2.0f, resolutionInTiles.y / 2.0f);
+    sf::Vector3i worldSize = world.getSize();
+
+    return getVisibleTileRect(cameraPosition, halfResInTiles, resolutionInTiles, {(uint32)worldSize.x, (uint32)worldSize.y});
+  }
+
+  // Streams in the chunks on screen and the ones around the player, on the player's floor and the
+  // floors nearby staircases lead to. Cheap unless one of them changed, loading happens on the loader thread.
+  void updateResidentChunks(const sf::IntRect& visibleTiles, sf::Vector3f playerPosition)
+  {
+    int32 playerX = (int32)std::floor(playerPosition.x);
+    int32 playerY = (int32)std::floor(playerPosition.y);
+    int32 left   = std::min(visibleTiles.left, playerX - chunkSize);
+    int32 top    = std::min(visibleTiles.top,  playerY - chunkSize);
+    int32 right  = std::max(visibleTiles.left + visibleTiles.width,  playerX + chunkSize + 1);
+    int32 bottom = std::max(visibleTiles.top  + visibleTiles.height, playerY + chunkSize + 1);
+    if(visibleTiles.width <= 0 || visibleTiles.height <= 0)
+    {
+      left  = playerX - chunkSize;     top    = playerY - chunkSize;
+      right = playerX + chunkSize + 1; bottom = playerY + chunkSize + 1;
+    }
+
+    world.updateResidency(sf::IntRect(left, top, right - left, bottom - top), (int32)std::floor(playerPosition.z));
+    wallEdges.update(world);
+    fieldOfView.update(world, sf::Vector3i(playerX, playerY, (int32)std::floor(playerPosition.z)), fieldOfViewRadius);
+  }
+
+  void finishLoading()
+  {
+    world.finishLoading();
+    wallEdges.update(world);
+  }
+
+  // Calls function with the wall outline segments around tileArea on a floor, see WallEdgeIndex.
+  template<typename Function>
+  void forEachWallSegment(const sf::IntRect& tileArea, uint32 level, Function function) const
+  {
+    wallEdges.forEachSegment(tileArea, (int32)level, function);
+  }
+
+  const WallEdgeIndex& getWallEdges() const { return wallEdges; }
+  const FieldOfView& getFieldOfView() const { return fieldOfView; }
+  void setRevealAll(bool reveal) { revealAll = reveal; }
+
+  // Images of the floors from the camera's floor down for every chunk on screen with something
+  // to draw, see CachedChunkImage. An image is only made again when tiles or the explored part
+  // under it change.
+  void getVisibleChunks(sf::Vector2u screenResolution, f32 tileSize, sf::Vector3f cameraPosition, std::vector<VisibleChunk>& chunks)
+  {
+    chunks.clear();
+    sf::Vector3i worldSize = world.getSize();
+    if(worldSize.y == 0) {LOG_ERROR("Map is not properly loaded height is equal to 0"); return;}
+
+    int32 endZ = std::max((int32)cameraPosition.z, (int32)0);
+    sf::IntRect visibleChunkRect = getChunkRect(getVisibleTiles(screenResolution, tileSize, cameraPosition));
+    // Images a chunk off screen are kept, so walking along a chunk border doesn't make them again.
+    sf::IntRect keptChunks(visibleChunkRect.left - 1, visibleChunkRect.top - 1, visibleChunkRect.width + 2, visibleChunkRect.height + 2);
+    for(ChunkImageMap::iterator it = chunkImages.begin(); it != chunkImages.end();)
+    {
+      if(keptChunks.contains(getChunkCoordinates(it->first))) ++it;
+      else it = chunkImages.erase(it);
+    }
+
+    for(int32 chunkY = visibleChunkRect.top; chunkY < visibleChunkRect.top + visibleChunkRect.height; chunkY++)
+      for(int32 chunkX = visibleChunkRect.left; chunkX < visibleChunkRect.left + visibleChunkRect.width; chunkX++)
+      {
+	std::shared_ptr<const ChunkImage> image = getChunkImage(chunkX, chunkY, endZ);
+	if(image) chunks.push_back(VisibleChunk{sf::Vector2i(chunkX, chunkY), std::move(image)});
+      }
+  }
+
+  // Draws the floors from the bottom up to the camera's floor as one quad per chunk on screen,
+  // for when the level is drawn on the thread that updates it.
+  RenderStats render(Renderer& renderer, f32 tileSize, sf::Vector3f cameraPosition) {
+    getVisibleChunks(renderer.getSize(), tileSize, cameraPosition, visibleChunks);
+    return chunkView.render(renderer, visibleChunks, tileSize, cameraPosition);
+  }
+
+  // Image of the floors from firstZ down in a chunk, made again first if it is out of date,
+  // null if there's nothing to draw in it.
+  std::shared_ptr<const ChunkImage> getChunkImage(int32 chunkX, int32 chunkY, int32 firstZ)
+  {
+    int32 floorCount = world.getSize().z;
+    bool anyResident = false;
+    chunkRevisions.clear();
+    for(int32 z = firstZ; z < floorCount; z++)
+    {
+      uint32 revision = world.getChunkRevision(chunkX, chunkY, z);
+      anyResident = anyResident || revision != 0;
+      chunkRevisions.push_back(revision);
+      chunkRevisions.push_back(revealAll ? 0 : fieldOfView.getExploredRevision(chunkX, chunkY, z));
+    }
+    if(!anyResident) return nullptr;
+
+    CachedChunkImage& cachedImage = chunkImages[getChunkKey(chunkX, chunkY)];
+    if(cachedImage.image && cachedImage.revisions == chunkRevisions && cachedImage.firstZ == firstZ &&
+       cachedImage.revealAll == revealAll) return cachedImage.image;
+
+    cachedImage.revisions = chunkRevisions;
+    cachedImage.firstZ = firstZ;
+    cachedImage.revealAll = revealAll;
+
+    // The old image may still be drawn from, so the new one goes into a new allocation.
+    std::shared_ptr<ChunkImage> image = std::make_shared<ChunkImage>();
+    image->id = ++imageCount;
+    image->tileCount = 0;
+    memset(image->pixels, 0, sizeof(image->pixels));
+
+    // Bit per tile column that a floor above already covers, everything under it is hidden.
+    uint32 covered[chunkSize] = {};
+    for(int32 z = firstZ; z < floorCount; z++)
+    {
+      const TileChunk* chunk = world.getChunk(chunkX, chunkY, z);
+      // Tiles the player has never seen aren't drawn at all.
+      const uint32* explored = fieldOfView.getExploredRows(chunkX, chunkY, z);
+      if(!chunk || (!explored && !revealAll)) continue;
+
+      for(int32 y = 0; y < chunkSize; y++)
+      {
+	const uint8* row = chunk->row(y);
+	uint32 exploredRow = revealAll ? 0xFFFFFFFFu : explored[y];
+	uint32 drawnRow = 0;
+	for(int32 x = 0; x < chunkSize; x++) drawnRow |= (uint32)(row[x] != TT_VOID) << x;
+	drawnRow &= exploredRow & ~covered[y];
+	covered[y] |= drawnRow;
+
+	for(int32 x = 0; x < chunkSize; x++)
+	{
+	  if((drawnRow >> x & 1) == 0) continue;
+	  sf::Color color = getTileColor((TILE_TYPE)row[x]);
+	  uint8* pixel = &image->pixels[(y * chunkSize + x) * 4];
+	  pixel[0] = color.r; pixel[1] = color.g; pixel[2] = color.b; pixel[3] = color.a;
+	  image->tileCount++;
+	}
+      }
+    }
+    cachedImage.image = image;
+    return cachedImage.image;
+  }
+
+  // Builds every tile on screen into one vertex batch per floor each frame, what render did before
+  // the chunk textures. Kept so -bench-render has something to compare against.
+  RenderStats renderBatched(sf::RenderWindow& renderWindow, f32 tileSize, sf::Vector3f cameraPosition) {
+    RenderStats stats = {};
+
+    sf::Vector2u screenResolution  = renderWindow.getSize();
+    sf::Vector2f resolutionInTiles ((f32)screenResolution.x / tileSize, (f32)screenResolution.y / tileSize);
+    sf::Vector2f halfResInTiles    (resolutionInTiles.x / 2.0f, resolutionInTiles.y / 2.0f);
+
+    sf::Vector3i worldSize = world.getSize();
+    if(worldSize.y == 0) {LOG_ERROR("Map is not properly loaded height is equal to 0"); return stats;}
+
+    int32 startZ = std::max(worldSize.z - 1, (int32)0);
+    int32 endZ   = std::max((int32)cameraPosition.z, (int32)0);
+    sf::IntRect visibleTiles  = getVisibleTiles(screenResolution, tileSize, cameraPosition);
+    sf::IntRect visibleChunks = getChunkRect(visibleTiles);
+    int32 visibleRight  = visibleTiles.left + visibleTiles.width;
+    int32 visibleBottom = visibleTiles.top  + visibleTiles.height;
+
+    for(int32 z = startZ; z >= endZ; --z)
+    {
+      // Whole layer goes out in a single draw call, the batch keeps its capacity between layers and frames.
+      tileBatch.clear();
+      for(int32 chunkY = visibleChunks.top; chunkY < visibleChunks.top + visibleChunks.height; chunkY++)
+	for(int32 chunkX = visibleChunks.left; chunkX < visibleChunks.left + visibleChunks.width; chunkX++)
+	{
+	  const TileChunk* chunk = world.getChunk(chunkX, chunkY, z);
+	  if(!chunk) continue;
+	  // Tiles the player has never seen aren't drawn at all.
+	  const uint32* explored = fieldOfView.getExploredRows(chunkX, chunkY, z);
+	  if(!explored && !revealAll) continue;
+
+	  int32 minX = std::max(visibleTiles.left, chunkX << chunkShift);
+	  int32 minY = std::max(visibleTiles.top,  chunkY << chunkShift);
+	  int32 maxX = std::min(visibleRight,  (chunkX + 1) << chunkShift);
+	  int32 maxY = std::min(visibleBottom, (chunkY + 1) << chunkShift);
+	  for(int32 y = minY; y < maxY; y++)
+	  {
+	    const uint8* row = chunk->row(y & chunkMask);
+	    uint32 exploredRow = revealAll ? 0xFFFFFFFFu : explored[y & chunkMask];
+	    for(int32 x = minX; x < maxX; x++)
+	    {
+	      TILE_TYPE tileType = (TILE_TYPE)row[x & chunkMask];
+	      if(tileType == TT_VOID || (exploredRow >> (x & chunkMask) & 1) == 0) continue;
+
+	      sf::Vector2f position((x - cameraPosition.x - halfResInTiles.x) * tileSize,
+				    (y - cameraPosition.y - halfResInTiles.y) * tileSize);
+
+	      appendTileQuad(tileBatch, position, tileSize, getTileColor(tileType));
+	    }
+	  }
+	}
+
+      if(tileBatch.getVertexCount() > 0)
+      {
+	renderWindow.draw(tileBatch);
+	stats.drawCalls++;
+	stats.tilesDrawn += (uint32)tileBatch.getVertexCount() / 4;
+      }
+    }
+    return stats;
+  }
+
+  // Old one shape per tile path, kept only so -bench-render has something to compare against.
+  RenderStats renderPerTile(sf::RenderWindow& renderWindow, f32 tileSize, sf::Vector3f cameraPosition) {
+    RenderStats stats = {};
+
+    sf::Vector2u screenResolution  = renderWindow.getSize();
+    sf::Vector2f resolutionInTiles ((f32)screenResolution.x / tileSize, (f32)screenResolution.y / tileSize);
+    sf::Vector2f halfResInTiles    (resolutionInTiles.x / 2.0f, resolutionInTiles.y / 2.0f);
+
+    sf::Vector3i worldSize = world.getSize();
+    int32 startZ = std::max(worldSize.z - 1, (int32)0);
+
+    for(int32 z = startZ; z >= (int32)cameraPosition.z; --z)
+    {
+      for(int32 y = 0; y < worldSize.y; y++)
+	for(int32 x = 0; x < worldSize.x; x++)
+	{
+	  TILE_TYPE tileType = world.getTile(x, y, z);
+	  if(tileType == TT_VOID) continue;
+
+	  sf::Vector2f position((x - cameraPosition.x - halfResInTiles.x) * tileSize,
+				(y - cameraPosition.y - halfResInTiles.y) * tileSize);
+
+	  sf::RectangleShape rs(sf::Vector2f(tileSize, tileSize));
+	  rs.setPosition(position);
+	  rs.setFillColor(getTileColor(tileType));
+	  renderWindow.draw(rs);
+	  stats.drawCalls++;
+	  stats.tilesDrawn++;
+	}
+    }
+    return stats;
+  }
+
+  TILE_TYPE getTile(const sf::Vector3f position) const
+  {
+    int32 x = (int32)std::floor(position.x);
+    int32 y = (int32)std::floor(position.y);
+    int32 z = (int32)std::floor(position.z);
+    return world.getTile(x, y, z);
+  }
+
+  bool isSolid(const sf::Vector2f& position, uint32 level) const
+  {
+    return world.isSolid((int32)std::floor(position.x), (int32)std::floor(position.y), (int32)level);
+  }
+
+  // Tests every tile the rect touches, edges included, not just the ones under its corners.
+  bool doesIntersectWithSolid(const sf::FloatRect& rect, uint32 level) const
+  {
+    int32 minX = (int32)std::floor(rect.left);
+    int32 minY = (int32)std::floor(rect.top);
+    int32 maxX = (int32)std::floor(rect.left + rect.width);
+    int32 maxY = (int32)std::floor(rect.top + rect.height);
+    return world.isAnySolid(sf::IntRect(minX, minY, maxX - minX + 1, maxY - minY + 1), (int32)level);
+  }
+
+  // Sweeps rect by delta against the walls of a floor and reports the first wall it runs into.
+  // Every tile the sweep passes over is tested, so nothing is skipped however long delta is.
+  // A rect already sunk deeper than collisionSkin into a wall isn't stopped by it, so it can
+  // always get out.
+  CollisionResult checkCollisions(const sf::FloatRect& rect, const sf::Vector2f& delta, uint32 level) const
+  {
+    CollisionResult result = {1.0f, sf::Vector2f(rect.left + rect.width / 2.0f + delta.x, rect.top + rect.height / 2.0f + delta.y), WS_TOP};
+
+    f32 right  = rect.left + rect.width;
+    f32 bottom = rect.top  + rect.height;
+    sf::Vector2i minTile((int32)std::floor(std::min(rect.left, rect.left + delta.x)), (int32)std::floor(std::min(rect.top, rect.top + delta.y)));
+    sf::Vector2i maxTile((int32)std::ceil(std::max(right, right + delta.x)) - 1, (int32)std::ceil(std::max(bottom, bottom + delta.y)) - 1);
+    TileSpan sweptTiles(minTile, maxTile);
+    if(sweptTiles.empty()) return result;
+    if(!world.isAnySolid(sf::IntRect(minTile, maxTile - minTile + sf::Vector2i(1, 1)), (int32)level)) return result;
+
+    sf::Vector2i hitTile;
+    bool hitOnX = false;
+    for(sf::Vector2i tile : sweptTiles)
+    {
+      if(!world.isSolid(tile.x, tile.y, (int32)level)) continue;
+
+      f32 entryX, exitX, entryY, exitY;
+      if(!getSweptOverlap(rect.left, right,  delta.x, (f32)tile.x, entryX, exitX)) continue;
+      if(!getSweptOverlap(rect.top,  bottom, delta.y, (f32)tile.y, entryY, exitY)) continue;
+
+      f32 entry = std::max(entryX, entryY);
+      f32 exit  = std::min(exitX, exitY);
+      if(entry >= exit || exit <= 0.0f || entry >= result.timeT) continue;
+
+      bool onX = entryX > entryY;
+      if(entry < 0.0f)
+      {
+	f32 depth = -entry * std::abs(onX ? delta.x : delta.y);
+	if(depth > collisionSkin) continue;
+	entry = 0.0f;
+      }
+
+      result.timeT = entry;
+      hitTile = tile;
+      hitOnX = onX;
+    }
+
+    if(result.timeT == 1.0f) return result;
+
+    // Middle of the stretch where the moved rect and the wall touch.
+    f32 left = rect.left + delta.x * result.timeT;
+    f32 top  = rect.top  + delta.y * result.timeT;
+    if(hitOnX)
+    {
+      result.ws = delta.x > 0.0f ? WS_LEFT : WS_RIGHT;
+      f32 overlapTop    = std::max(top, (f32)hitTile.y);
+      f32 overlapBottom = std::min(top + rect.height, (f32)hitTile.y + 1.0f);
+      result.collisionPoint = sf::Vector2f(delta.x > 0.0f ? (f32)hitTile.x : (f32)hitTile.x + 1.0f, (overlapTop + overlapBottom) / 2.0f);
+    }
+    else
+    {
+      result.ws = delta.y > 0.0f ? WS_TOP : WS_BOTTOM;
+      f32 overlapLeft  = std::max(left, (f32)hitTile.x);
+      f32 overlapRight = std::min(left + rect.width, (f32)hitTile.x + 1.0f);
+      result.collisionPoint = sf::Vector2f((overlapLeft + overlapRight) / 2.0f, delta.y > 0.0f ? (f32)hitTile.y : (f32)hitTile.y + 1.0f);
+    }
+    return result;
+  }
+
+  // Steps the ray through the floor a tile at a time (Amanatides & Woo) until it enters a wall
+  // or goes past maxDistance. Outside of the world counts as wall, like everywhere else.
+  RaycastHit raycast(const Ray& ray, uint32 level) const
+  {
+    RaycastHit result = {false, sf::Vector2i(), ray.maxDistance, WS_TOP};
+    const f32 farAway = std::numeric_limits<f32>::max();
+
+    f32 length = std::sqrt(ray.direction.x * ray.direction.x + ray.direction.y * ray.direction.y);
+    sf::Vector2f direction = length > 0.0f ? ray.direction / length : sf::Vector2f();
+
+    sf::Vector2i tile((int32)std::floor(ray.origin.x), (int32)std::floor(ray.origin.y));
+    sf::Vector2i step(direction.x > 0.0f ? 1 : -1, direction.y > 0.0f ? 1 : -1);
+    // Distance along the ray to cross one whole tile, and to the next tile border, on each axis.
+    sf::Vector2f tileDistance(direction.x != 0.0f ? std::abs(1.0f / direction.x) : farAway,
+			      direction.y != 0.0f ? std::abs(1.0f / direction.y) : farAway);
+    sf::Vector2f nextBorder(direction.x > 0.0f ? ((f32)tile.x + 1.0f - ray.origin.x) * tileDistance.x :
+			    direction.x < 0.0f ? (ray.origin.x - (f32)tile.x) * tileDistance.x : farAway,
+			    direction.y > 0.0f ? ((f32)tile.y + 1.0f - ray.origin.y) * tileDistance.y :
+			    direction.y < 0.0f ? (ray.origin.y - (f32)tile.y) * tileDistance.y : farAway);
+
+    // A ray that started inside a wall reports the side it would have come in through.
+    WALL_SIDE ws = std::abs(direction.x) > std::abs(direction.y) ? (step.x > 0 ? WS_LEFT : WS_RIGHT) : (step.y > 0 ? WS_TOP : WS_BOTTOM);
+    f32 distance = 0.0f;
+
+    // The wall bits of the chunk the ray is in, only looked up again once it leaves the chunk.
+    sf::Vector2i chunk(tile.x >> chunkShift, tile.y >> chunkShift);
+    const uint32* solidRows = world.contains(tile.x, tile.y, (int32)level) ? world.getSolidRows(chunk.x, chunk.y, (int32)level) : nullptr;
+
+    for(;;)
+    {
+      bool solid;
+      if(!world.contains(tile.x, tile.y, (int32)level)) solid = true;
+      else
+      {
+	sf::Vector2i tileChunk(tile.x >> chunkShift, tile.y >> chunkShift);
+	if(tileChunk != chunk)
+	{
+	  chunk = tileChunk;
+	  solidRows = world.getSolidRows(chunk.x, chunk.y, (int32)level);
+	}
+	solid = solidRows && (solidRows[tile.y & chunkMask] >> (tile.x & chunkMask) & 1) != 0;
+      }
+
+      if(solid)
+      {
+	result.hit = true;
+	result.tile = tile;
+	result.distance = distance;
+	result.ws = ws;
+	return result;
+      }
+
+      if(nextBorder.x < nextBorder.y)
+      {
+	distance = nextBorder.x;
+	nextBorder.x += tileDistance.x;
+	tile.x += step.x;
+	ws = step.x > 0 ? WS_LEFT : WS_RIGHT;
+      }
+      else
+      {
+	distance = nextBorder.y;
+	nextBorder.y += tileDistance.y;
+	tile.y += step.y;
+	ws = step.y > 0 ? WS_TOP : WS_BOTTOM;
+      }
+      if(distance > ray.maxDistance || distance == farAway) return result;
+    }
+  }
+
+  // Casts count rays into hits, all on the same floor.
+  void raycast(const Ray* rays, size_t count, uint32 level, RaycastHit* hits) const
+  {
+    for(size_t i = 0; i < count; i++) hits[i] = raycast(rays[i], level);
+  }
+
+  // Tiles a point can touch moving from startPosition by deltaVector, iterate it directly:
+  // for(sf::Vector2i tile : Level::getCollidingTiles(position, delta)).
+  static TileSpan getCollidingTiles(const sf::Vector2f& startPosition, const sf::Vector2f& deltaVector)
+  {
+    return TileSpan::between(startPosition, startPosition + deltaVector);
+  }
+};
+
+class Player {
+public:
+  sf::Vector3f position;
+  // Where the last move started, rendering goes between the two.
+  sf::Vector3f previousPosition;
+  sf::Vector2f dimensions;
+  static constexpr float movementSpeed = 5.0f;
+
+  void move(const Input& input, const Level& level, f32 lastDelta)
+  {
+    previousPosition = position;
+    sf::Vector2f deltaVector;
+
+    if(input.keysDown[sf::Keyboard::W]) deltaVector.y -= movementSpeed;
+    if(input.keysDown[sf::Keyboard::S]) deltaVector.y += movementSpeed;
+
+    if(input.keysDown[sf::Keyboard::A]) deltaVector.x -= movementSpeed;
+    if(input.keysDown[sf::Keyboard::D]) deltaVector.x += movementSpeed;
+
+    deltaVector *= lastDelta;
+
+    sf::FloatRect playerRect(position.x - dimensions.x / 2.0f, position.y - dimensions.y / 2.0f, dimensions.x, dimensions.y);
+
+    // Moves up to the first wall, then whatever is left of the step slides along it. After two
+    // walls both directions are blocked, so that's as far as it goes.
+    for(uint32 i = 0; i < 2 && (deltaVector.x != 0.0f || deltaVector.y != 0.0f); i++)
+    {
+      CollisionResult cr = level.checkCollisions(playerRect, deltaVector, (uint32)position.z);
+      playerRect.left += deltaVector.x * cr.timeT;
+      playerRect.top  += deltaVector.y * cr.timeT;
+      if(cr.timeT == 1.0f) break;
+
+      deltaVector *= 1.0f - cr.timeT;
+      if(cr.ws == WS_LEFT || cr.ws == WS_RIGHT) deltaVector.x = 0.0f;
+      else deltaVector.y = 0.0f;
+    }
+
+    position.x = playerRect.left + dimensions.x / 2.0f;
+    position.y = playerRect.top  + dimensions.y / 2.0f;
+  }
+
+  // alpha is how far between the last two steps to draw the player, see FixedTimestep::getAlpha.
+  void render(Renderer& renderer, f32 tileSize, f32 alpha) const
+  {
+    // Position is the center of the player
+    sf::Vector3f drawnPosition = previousPosition + (position - previousPosition) * alpha;
+    renderer.fillRect(sf::FloatRect((drawnPosition.x - dimensions.x / 2.0f) * tileSize, (drawnPosition.y - dimensions.y / 2.0f) * tileSize,
+				    dimensions.x * tileSize, dimensions.y * tileSize), sf::Color::Magenta);
+  }
+};
+
+// Everything a frame is drawn from, copied out of the simulation at the end of a tick so the
+// render thread never touches Level or the live Player.
+struct FrameSnapshot {
+  uint64 tick = 0;
+  // Seconds on the clock both threads share when the tick was published.
+  f32 time = 0.0f;
+  f32 tileSize = 0.0f;
+  sf::Vector3f cameraPosition;
+  sf::Color clearColor;
+  Player player;
+  // Chunks whose tiles changed since the last snapshot come with a new image, see ChunkView.
+  std::vector<VisibleChunk> chunks;
+};
+
+// What the window thread collected for the simulation since its last tick. Events can only be
+// polled on the thread that made the window, so they are handed over under a lock held just for
+// the copy.
+struct WindowInput {
+  std::mutex mutex;
+  Input input;
+  sf::Vector2i mousePosition;
+  sf::Vector2u resolution;
+};
+
+#ifdef ZHALE_PROFILE
+// Frame times of the last frames as bars along the bottom of the screen, 4 pixels a millisecond
+// up to 50 ms. Bars are yellow past 60 fps and red past 30, the lines across are the 50th, 95th
+// and 99th percentile.
+void renderFrameGraph(Renderer& renderer, const FrameTimeHistory& frameTimes)
+{
+  const f32 pixelsPerMs = 4.0f;
+  const f32 barWidth    = 2.0f;
+  const f32 height      = 50.0f * pixelsPerMs;
+  const f32 width       = (f32)FrameTimeHistory::capacity * barWidth;
+  sf::Vector2f origin(10.0f, (f32)renderer.getSize().y - 10.0f);
+
+  renderer.fillRect(sf::FloatRect(origin.x, origin.y - height, width, height), sf::Color(0, 0, 0, 160));
+  for(uint32 i = 0; i < frameTimes.getCount(); i++)
+  {
+    f32 frameTime = frameTimes.get(i);
+    f32 barHeight = std::min(frameTime * pixelsPerMs, height);
+    sf::Color color = frameTime > 1000.0f / 30.0f ? sf::Color::Red : frameTime > 1000.0f / 60.0f ? sf::Color::Yellow : sf::Color::Green;
+    renderer.fillRect(sf::FloatRect(origin.x + (f32)i * barWidth, origin.y - barHeight, barWidth, barHeight), color);
+  }
+
+  f32 percentiles[] = {50.0f, 95.0f, 99.0f};
+  sf::Color lineColors[] = {sf::Color::White, sf::Color(255, 160, 0), sf::Color::Magenta};
+  for(uint32 i = 0; i < 3; i++)
+  {
+    f32 lineHeight = std::min(frameTimes.getPercentile(percentiles[i]) * pixelsPerMs, height);
+    renderer.fillRect(sf::FloatRect(origin.x, origin.y - lineHeight, width, 1.0f), lineColors[i]);
+  }
+}
+#endif
+
+struct IntersectionResult {
+  bool intersectionHappened;
+  sf::Vector2f intersectionPoint;
+};
+
+// Where along p + t * r the segment q + u * s is crossed, as t in [0, 1], -1 if it isn't. rr is
+// r dotted with itself. Parallel segments only meet when they are collinear, then the hit is
+// the first point they share. The SIMD kernels below do the same operations in the same order,
+// so they get the same bits.
+inline f32 intersectSegment(f32 px, f32 py, f32 rx, f32 ry, f32 rr, f32 qx, f32 qy, f32 sx, f32 sy)
+{
+  f32 qpx = qx - px;
+  f32 qpy = qy - py;
+  f32 denom    = rx * sy - ry * sx;
+  f32 qpCrossS = qpx * sy - qpy * sx;
+  f32 qpCrossR = qpx * ry - qpy * rx;
+
+  if(denom != 0.0f)
+  {
+    f32 t = qpCrossS / denom;
+    f32 u = qpCrossR / denom;
+    return t >= 0.0f && t <= 1.0f && u >= 0.0f && u <= 1.0f ? t : -1.0f;
+  }
+
+  if(qpCrossR != 0.0f || rr == 0.0f) return -1.0f;
+  f32 t0 = (qpx * rx + qpy * ry) / rr;
+  f32 t1 = t0 + (sx * rx + sy * ry) / rr;
+  f32 first = std::max(std::min(t0, t1), 0.0f);
+  f32 last  = std::min(std::max(t0, t1), 1.0f);
+  return first <= last ? first : -1.0f;
+}
+
+IntersectionResult getPointOfIntersection(const sf::Vector2f& p0, const sf::Vector2f& p1,
+					  const sf::Vector2f& p2, const sf::Vector2f& p3)
+{
+  IntersectionResult result = {};
+
+  sf::Vector2f r = p1 - p0;
+  sf::Vector2f s = p3 - p2;
+  f32 t = intersectSegment(p0.x, p0.y, r.x, r.y, r.x * r.x + r.y * r.y, p2.x, p2.y, s.x, s.y);
+
+  if(t >= 0.0f)
+  {
+    result.intersectionPoint = p0 + r * t;
+    result.intersectionHappened = true;
+  }
+  else {
+    result.intersectionHappened = false;
+  }
+
+  return result;
+}
+
+// Segments stored as separate arrays of start and delta coordinates, so 8 of them load into
+// one register each. Meant for the walls lighting and visibility test against every frame.
+struct SegmentBatch {
+  std::vector<f32> startX, startY, deltaX, deltaY;
+
+  void add(const sf::Vector2f& start, const sf::Vector2f& end)
+  {
+    startX.push_back(start.x);
+    startY.push_back(start.y);
+    deltaX.push_back(end.x - start.x);
+    deltaY.push_back(end.y - start.y);
+  }
+
+  void clear() { startX.clear(); startY.clear(); deltaX.clear(); deltaY.clear(); }
+  size_t size() const { return startX.size(); }
+};
+
+// Closest of the segments in a batch that p0 to p1 crosses, segment is the index into the batch.
+struct SegmentHit {
+  bool hit;
+  f32 t;
+  uint32 segment;
+  sf::Vector2f point;
+};
+
+// Ties go to the lowest index, the SIMD kernels keep that too.
+void intersectSegmentsScalar(f32 px, f32 py, f32 rx, f32 ry, const SegmentBatch& segments, size_t first,
+			     f32& bestT, uint32& bestSegment)
+{
+  f32 rr = rx * rx + ry * ry;
+  for(size_t i = first; i < segments.size(); i++)
+  {
+    f32 t = intersectSegment(px, py, rx, ry, rr, segments.startX[i], segments.startY[i], segments.deltaX[i], segments.deltaY[i]);
+    if(t >= 0.0f && t < bestT) { bestT = t; bestSegment = (uint32)i; }
+  }
+}
+
+#ifdef ZHALE_X64
+// intersectSegment on 8 segments at a time. Both the crossing and the collinear answer are worked
+// out for every lane and the right one is picked by whether the lane is parallel. Zero divisors
+// are swapped for ones first so nothing turns into inf or NaN.
+ZHALE_TARGET_AVX2
+void intersectSegmentsAvx2(f32 px, f32 py, f32 rx, f32 ry, const SegmentBatch& segments,
+			   f32& bestT, uint32& bestSegment)
+{
+  f32 rr = rx * rx + ry * ry;
+  __m256 pX = _mm256_set1_ps(px), pY = _mm256_set1_ps(py);
+  __m256 rX = _mm256_set1_ps(rx), rY = _mm256_set1_ps(ry);
+  __m256 rrs   = _mm256_set1_ps(rr == 0.0f ? 1.0f : rr);
+  __m256 rrOk  = _mm256_castsi256_ps(_mm256_set1_epi32(rr == 0.0f ? 0 : -1));
+  __m256 zero  = _mm256_setzero_ps();
+  __m256 one   = _mm256_set1_ps(1.0f);
+  __m256 noHit = _mm256_set1_ps(std::numeric_limits<f32>::max());
+
+  __m256  laneBestT       = noHit;
+  __m256i laneBestSegment = _mm256_setzero_si256();
+  __m256i segmentIndex    = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i eight           = _mm256_set1_epi32(8);
+
+  size_t i = 0;
+  for(; i + 8 <= segments.size(); i += 8, segmentIndex = _mm256_add_epi32(segmentIndex, eight))
+  {
+    __m256 qpX = _mm256_sub_ps(_mm256_loadu_ps(&segments.startX[i]), pX);
+    __m256 qpY = _mm256_sub_ps(_mm256_loadu_ps(&segments.startY[i]), pY);
+    __m256 sX  = _mm256_loadu_ps(&segments.deltaX[i]);
+    __m256 sY  = _mm256_loadu_ps(&segments.deltaY[i]);
+
+    __m256 denom    = _mm256_sub_ps(_mm256_mul_ps(rX, sY), _mm256_mul_ps(rY, sX));
+    __m256 qpCrossS = _mm256_sub_ps(_mm256_mul_ps(qpX, sY), _mm256_mul_ps(qpY, sX));
+    __m256 qpCrossR = _mm256_sub_ps(_mm256_mul_ps(qpX, rY), _mm256_mul_ps(qpY, rX));
+    __m256 parallel = _mm256_cmp_ps(denom, zero, _CMP_EQ_OQ);
+
+    __m256 safeDenom = _mm256_blendv_ps(denom, one, parallel);
+    __m256 t = _mm256_div_ps(qpCrossS, safeDenom);
+    __m256 u = _mm256_div_ps(qpCrossR, safeDenom);
+    __m256 crosses = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(t, zero, _CMP_GE_OQ), _mm256_cmp_ps(t, one, _CMP_LE_OQ)),
+				   _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(u, one, _CMP_LE_OQ)));
+
+    __m256 t0 = _mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(qpX, rX), _mm256_mul_ps(qpY, rY)), rrs);
+    __m256 t1 = _mm256_add_ps(t0, _mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(sX, rX), _mm256_mul_ps(sY, rY)), rrs));
+    __m256 first = _mm256_max_ps(_mm256_min_ps(t0, t1), zero);
+    __m256 last  = _mm256_min_ps(_mm256_max_ps(t0, t1), one);
+    __m256 collinear = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(qpCrossR, zero, _CMP_EQ_OQ), rrOk), _mm256_cmp_ps(first, last, _CMP_LE_OQ));
+
+    __m256 hitT = _mm256_blendv_ps(t, first, parallel);
+    __m256 hit  = _mm256_blendv_ps(crosses, collinear, parallel);
+    __m256 closer = _mm256_and_ps(hit, _mm256_cmp_ps(hitT, laneBestT, _CMP_LT_OQ));
+    laneBestT       = _mm256_blendv_ps(laneBestT, hitT, closer);
+    laneBestSegment = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(laneBestSegment), _mm256_castsi256_ps(segmentIndex), closer));
+  }
+
+  f32 lanesT[8];
+  uint32 lanesSegment[8];
+  _mm256_storeu_ps(lanesT, laneBestT);
+  _mm256_storeu_si256((__m256i*)lanesSegment, laneBestSegment);
+  for(uint32 lane = 0; lane < 8; lane++)
+  {
+    if(lanesT[lane] == std::numeric_limits<f32>::max()) continue;
+    if(lanesT[lane] < bestT || (lanesT[lane] == bestT && lanesSegment[lane] < bestSegment))
+    {
+      bestT = lanesT[lane];
+      bestSegment = lanesSegment[lane];
+    }
+  }
+  intersectSegmentsScalar(px, py, rx, ry, segments, i, bestT, bestSegment);
+}
+#endif
+
+// Finds the closest segment of the batch that p0 to p1 crosses, with AVX2 when the CPU has it.
+SegmentHit getNearestIntersection(const sf::Vector2f& p0, const sf::Vector2f& p1, const SegmentBatch& segments)
+{
+  sf::Vector2f r = p1 - p0;
+  f32 bestT = std::numeric_limits<f32>::max();
+  uint32 bestSegment = 0;
+#ifdef ZHALE_X64
+  static const bool hasAvx2 = cpuSupportsAvx2();
+  if(hasAvx2) intersectSegmentsAvx2(p0.x, p0.y, r.x, r.y, segments, bestT, bestSegment);
+  else intersectSegmentsScalar(p0.x, p0.y, r.x, r.y, segments, 0, bestT, bestSegment);
+#else
+  intersectSegmentsScalar(p0.x, p0.y, r.x, r.y, segments, 0, bestT, bestSegment);
+#endif
+
+  SegmentHit result = {false, 1.0f, 0, p1};
+  if(bestT == std::numeric_limits<f32>::max()) return result;
+  result.hit = true;
+  result.t = bestT;
+  result.segment = bestSegment;
+  result.point = p0 + r * bestT;
+  return result;
+}
+
+// Same as getNearestIntersection for count queries, one result each.
+void getNearestIntersections(const sf::Vector2f* starts, const sf::Vector2f* ends, size_t count,
+			     const SegmentBatch& segments, SegmentHit* hits)
+{
+  for(size_t i = 0; i < count; i++) hits[i] = getNearestIntersection(starts[i], ends[i], segments);
+}
+
+// Linear congruential step, the benchmarks and the scripted input only need cheap numbers that
+// come out the same for the same seed. The low bits repeat quickly, use the high ones.
+inline uint32 nextRandom(uint32& seed)
+{
+  seed = seed * 1664525u + 1013904223u;
+  return seed;
+}
+
+// In [0, 1), from the 24 high bits.
+inline f32 randomUnit(uint32& seed) { return (f32)(nextRandom(seed) >> 8) / (f32)(1 << 24); }
+
+// Times random getTile lookups and full layer scans on the flat Grid3D against the same
+// tiles stored the old way, as nested std::vectors of TILE_TYPE.
+void runGridBenchmark(uint32 width, uint32 height, uint32 depth, uint32 lookupCount)
+{
+  Grid3D grid;
+  grid.resize(width, height, depth);
+  std::vector<std::vector<std::vector<TILE_TYPE>>> nested(depth, std::vector<std::vector<TILE_TYPE>>(height, std::vector<TILE_TYPE>(width)));
+
+  uint32 seed = 12345;
+  for(uint32 z = 0; z < depth; z++)
+    for(uint32 y = 0; y < height; y++)
+      for(uint32 x = 0; x < width; x++)
+      {
+	TILE_TYPE tileType = (TILE_TYPE)((nextRandom(seed) >> 24) % 5);
+	grid.set(x, y, z, tileType);
+	nested[z][y][x] = tileType;
+      }
+
+  std::vector<sf::Vector3i> lookups(lookupCount);
+  for(uint32 i = 0; i < lookupCount; i++)
+  {
+    lookups[i].x = (int32)((nextRandom(seed) >> 8) % width);
+    lookups[i].y = (int32)((nextRandom(seed) >> 8) % height);
+    lookups[i].z = (int32)((nextRandom(seed) >> 8) % depth);
+  }
+
+  uint32 nestedWalls = 0, gridWalls = 0;
+  sf::Clock clock;
+  for(const sf::Vector3i& p : lookups) nestedWalls += nested[p.z][p.y][p.x] == TT_WALL;
+  f32 nestedLookupTime = clock.restart().asSeconds();
+  for(const sf::Vector3i& p : lookups) gridWalls += grid.get(p.x, p.y, p.z) == TT_WALL;
+  f32 gridLookupTime = clock.restart().asSeconds();
+
+  for(uint32 z = 0; z < depth; z++)
+    for(uint32 y = 0; y < height; y++)
+      for(uint32 x = 0; x < width; x++)
+	nestedWalls += nested[z][y][x] == TT_WALL;
+  f32 nestedScanTime = clock.restart().asSeconds();
+  for(uint32 z = 0; z < depth; z++)
+  {
+    ConstGridLayer layer = grid.layer(z);
+    for(uint32 y = 0; y < height; y++)
+    {
+      const uint8* row = layer.row(y);
+      for(uint32 x = 0; x < width; x++) gridWalls += row[x] == TT_WALL;
+    }
+  }
+  f32 gridScanTime = clock.restart().asSeconds();
+
+  size_t nestedBytes = (size_t)width * height * depth * sizeof(TILE_TYPE) + (size_t)height * depth * sizeof(nested[0][0]);
+  f32 tileCount = (f32)width * height * depth;
+  std::cout << "grid " << width << "x" << height << "x" << depth << ", walls counted: " << nestedWalls << " / " << gridWalls << "\n";
+  std::cout << "nested: " << nestedBytes / 1024 << " KiB\t getTile: " << nestedLookupTime * 1e9f / lookupCount << " ns\t layer scan: " << nestedScanTime * 1e9f / tileCount << " ns/tile\n";
+  std::cout << "Grid3D: " << grid.getSizeInBytes() / 1024 << " KiB\t getTile: " << gridLookupTime * 1e9f / lookupCount << " ns\t layer scan: " << gridScanTime * 1e9f / tileCount << " ns/tile\n";
+}
+
+// Walks a player diagonally across a generated world, changing floors a few times on the way,
+// and reports how many chunks stay resident and what streaming, isSolid lookups and
+// player-sized rect queries cost the main thread. The worst update shows whether the walk
+// would ever hitch a frame.
+void runWorldBenchmark(int32 worldSize, int32 floorCount, int32 stepCount)
+{
+  Level level;
+  level.setSource(std::make_unique<GeneratedChunkSource>(sf::Vector3i(worldSize, worldSize, floorCount)));
+
+  // About what a 1280x720 window shows with 64 pixel tiles.
+  sf::Vector2i viewSize(20, 12);
+  size_t maxResidentChunks = 0, maxResidentBytes = 0;
+  uint32 solidCount = 0, lookupCount = 0, rectHitCount = 0, rectCount = 0;
+  f32 updateTime = 0.0f, maxUpdateTime = 0.0f, lookupTime = 0.0f, rectTime = 0.0f;
+  sf::Clock clock;
+
+  for(int32 step = 0; step < stepCount; step++)
+  {
+    f32 distance = (f32)step * (f32)(worldSize - 1) / (f32)stepCount;
+    int32 floor  = (int32)((int64)step * floorCount * 4 / stepCount) % floorCount;
+    sf::Vector3f position(distance, distance, (f32)floor);
+    sf::IntRect visibleTiles((int32)position.x - viewSize.x / 2, (int32)position.y - viewSize.y / 2, viewSize.x, viewSize.y);
+
+    clock.restart();
+    level.updateResidentChunks(visibleTiles, position);
+    f32 stepUpdateTime = clock.restart().asSeconds();
+    updateTime   += stepUpdateTime;
+    maxUpdateTime = std::max(maxUpdateTime, stepUpdateTime);
+
+    for(int32 y = -4; y < 4; y++)
+      for(int32 x = -4; x < 4; x++)
+      {
+	solidCount += level.isSolid({position.x + (f32)x, position.y + (f32)y}, floor);
+	lookupCount++;
+      }
+    lookupTime += clock.restart().asSeconds();
+
+    for(int32 i = 0; i < 64; i++)
+    {
+      sf::FloatRect rect(position.x + (f32)(i % 8) * 0.55f - 2.0f, position.y + (f32)(i / 8) * 0.55f - 2.0f, 0.8f, 0.8f);
+      rectHitCount += level.doesIntersectWithSolid(rect, floor);
+      rectCount++;
+    }
+    rectTime += clock.restart().asSeconds();
 
-typedef std::vector<std::vector<TILE_TYPE>> TileMap2D;
-typedef std::vector<TileMap2D> TileMap3D;
+    maxResidentChunks = std::max(maxResidentChunks, level.getWorld().getResidentChunkCount());
+    maxResidentBytes  = std::max(maxResidentBytes,  level.getWorld().getResidentBytes());
+  }
 
-enum WALL_SIDE {
-  WS_TOP,
-  WS_RIGHT,
-  WS_BOTTOM,
-  WS_LEFT
-};
+  std::cout << "world " << worldSize << "x" << worldSize << "x" << floorCount << ", " << stepCount << " steps, solid hits: " << solidCount << "\n";
+  std::cout << "max resident chunks: " << maxResidentChunks << "\t max resident memory: " << maxResidentBytes / 1024 << " KiB\n";
+  std::cout << "residency update: " << updateTime * 1e6f / (f32)stepCount << " us/step\t worst: " << maxUpdateTime * 1e6f << " us\t isSolid: " <<
+    lookupTime * 1e9f / (f32)lookupCount << " ns\n";
+  std::cout << "rect queries: " << rectTime * 1e9f / (f32)rectCount << " ns\t hits: " << rectHitCount << " / " << rectCount << "\n";
+}
 
-struct CollisionResult {
-  f32 timeT;
-  sf::Vector2f collisionPoint;
-  WALL_SIDE ws;
-};
+// Classifies one big generated map with getPixel and chained sf::Color compares, the way the
+// importer used to, and with every palette kernel the CPU supports.
+void runPaletteBenchmark(uint32 size, uint32 runCount)
+{
+  const sf::Color colors[] = {sf::Color::White, sf::Color::Black, staircaseDownColor, staircaseUpColor,
+			      sf::Color::Transparent, sf::Color(1, 2, 3)};
+  sf::Image image;
+  image.create(size, size);
+  uint32 seed = 12345;
+  for(uint32 y = 0; y < size; y++)
+    for(uint32 x = 0; x < size; x++)
+    {
+      image.setPixel(x, y, colors[(nextRandom(seed) >> 24) % 6]);
+    }
 
-class Level {
-private:
-  TileMap3D tileMap3D;
-public:
-  bool loadFromFile(const std::string& baseFilename, uint32 levelCount)
+  size_t pixelCount = (size_t)size * size;
+  std::vector<uint8> expected(pixelCount), tiles(pixelCount);
+  sf::Clock clock;
+  for(uint32 run = 0; run < runCount; run++)
+    for(uint32 y = 0; y < size; y++)
+      for(uint32 x = 0; x < size; x++)
+      {
+	TILE_TYPE tt = TT_VOID;
+	sf::Color pixelColor = image.getPixel(x, y);
+	if      (pixelColor == sf::Color::White)   tt = TT_FLOOR;
+	else if (pixelColor == sf::Color::Black)   tt = TT_WALL;
+	else if (pixelColor == staircaseDownColor) tt = TT_STAIRCASE_DOWN;
+	else if (pixelColor == staircaseUpColor)   tt = TT_STAIRCASE_UP;
+	expected[(size_t)y * size + x] = (uint8)tt;
+      }
+  std::cout << "getPixel: " << clock.getElapsedTime().asSeconds() * 1e9f / (f32)(pixelCount * runCount) << " ns/pixel\n";
+
+  typedef size_t (*ClassifyFunction)(const uint8*, uint8*, size_t, const TilePalette&);
+  struct Kernel { const char* name; ClassifyFunction function; };
+  std::vector<Kernel> kernels = {{"scalar", classifyPixelsScalar}};
+#ifdef ZHALE_X64
+  kernels.push_back({"SSE2", classifyPixelsSse2});
+  if(cpuSupportsAvx2()) kernels.push_back({"AVX2", classifyPixelsAvx2});
+#endif
+
+  TilePalette palette = getTilePalette();
+  for(const Kernel& kernel : kernels)
   {
-    tileMap3D.resize(levelCount);
+    size_t unknownCount = 0;
+    clock.restart();
+    for(uint32 run = 0; run < runCount; run++) unknownCount = kernel.function(image.getPixelsPtr(), &tiles[0], pixelCount, palette);
+    f32 time = clock.getElapsedTime().asSeconds() * 1e9f / (f32)(pixelCount * runCount);
 
-    TileMap2D& tileMap2D = tileMap3D[0];
+    std::cout << kernel.name << ": " << time << " ns/pixel\t unknown pixels: " << unknownCount <<
+      (tiles == expected ? "" : "\t MISMATCH") << "\n";
+  }
+}
 
-    for(uint32 i = 0; i < levelCount; i++)
+// Casts queryCount random segments against segmentCount random walls, a tenth of them lying on
+// the same few lines so parallel and collinear pairs come up, through every kernel the CPU has.
+void runSegmentBenchmark(uint32 segmentCount, uint32 queryCount)
+{
+  uint32 seed = 12345;
+  auto randomUpTo = [&seed](f32 range) { return randomUnit(seed) * range; };
+
+  SegmentBatch segments;
+  for(uint32 i = 0; i < segmentCount; i++)
+  {
+    if(i % 10 == 0)
     {
-      std::string filename = baseFilename + std::to_string(i+1) + ".png";
-      tileMap3D[i] = loadFromFile2D(filename);
-      if(tileMap3D[i].size() == 0) {
-	std::cout << "Level: " << filename << " couldn't be loaded !\n";
-	return false;
-      }
+      f32 y = (f32)(int32)randomUpTo(4.0f) * 16.0f;
+      f32 x = randomUpTo(64.0f);
+      segments.add({x, y}, {x + randomUpTo(8.0f), y});
+      continue;
     }
+    sf::Vector2f start(randomUpTo(64.0f), randomUpTo(64.0f));
+    segments.add(start, start + sf::Vector2f(randomUpTo(8.0f) - 4.0f, randomUpTo(8.0f) - 4.0f));
+  }
 
-    if(tileMap2D.size() > 0) return true;
-    else return false;
+  std::vector<sf::Vector2f> starts(queryCount), ends(queryCount);
+  for(uint32 i = 0; i < queryCount; i++)
+  {
+    starts[i] = sf::Vector2f(randomUpTo(64.0f), randomUpTo(64.0f));
+    ends[i]   = sf::Vector2f(randomUpTo(64.0f), randomUpTo(64.0f));
+    // Some queries run along the same lines as the collinear walls.
+    if(i % 10 == 0) starts[i].y = ends[i].y = (f32)(int32)randomUpTo(4.0f) * 16.0f;
   }
 
-  TileMap2D loadFromFile2D(const std::string& filename)
+  typedef void (*IntersectFunction)(f32, f32, f32, f32, const SegmentBatch&, f32&, uint32&);
+  struct Kernel { const char* name; IntersectFunction function; };
+  std::vector<Kernel> kernels = {{"scalar", [](f32 px, f32 py, f32 rx, f32 ry, const SegmentBatch& batch, f32& bestT, uint32& bestSegment) {
+	intersectSegmentsScalar(px, py, rx, ry, batch, 0, bestT, bestSegment); }}};
+#ifdef ZHALE_X64
+  if(cpuSupportsAvx2()) kernels.push_back({"AVX2", intersectSegmentsAvx2});
+#endif
+
+  std::vector<uint32> expected;
+  for(const Kernel& kernel : kernels)
   {
-    TileMap2D tileMap2D;
-    sf::Image image;
-    if(image.loadFromFile(filename))
+    std::vector<uint32> nearest(queryCount);
+    uint32 hitCount = 0;
+    sf::Clock clock;
+    for(uint32 i = 0; i < queryCount; i++)
     {
-      sf::Vector2u size = image.getSize();
-      tileMap2D.resize(size.y);
-      for(uint32 y = 0; y < size.y; y++)
-      {
-	tileMap2D[y].resize(size.x);
-	for(uint32 x = 0; x < size.x; x++)
-	{
-	  TILE_TYPE tt = TT_VOID;
-	  sf::Color pixelColor = image.getPixel(x, y);
-	  if      (pixelColor == sf::Color::White)   tt = TT_FLOOR;
-	  else if (pixelColor == sf::Color::Black)   tt = TT_WALL;
-	  else if (pixelColor == staircaseDownColor) tt = TT_STAIRCASE_DOWN;
-	  else if (pixelColor == staircaseUpColor)   tt = TT_STAIRCASE_UP;
-
-	  tileMap2D[y][x] = tt;
-	}
-      }
+      f32 bestT = std::numeric_limits<f32>::max();
+      uint32 bestSegment = 0;
+      kernel.function(starts[i].x, starts[i].y, ends[i].x - starts[i].x, ends[i].y - starts[i].y, segments, bestT, bestSegment);
+      bool hit = bestT != std::numeric_limits<f32>::max();
+      nearest[i] = hit ? bestSegment : 0xFFFFFFFF;
+      hitCount += hit;
     }
-    return tileMap2D;
+    f32 time = clock.getElapsedTime().asSeconds() * 1e9f / ((f32)queryCount * (f32)segmentCount);
+    if(expected.empty()) expected = nearest;
+
+    std::cout << kernel.name << ": " << time << " ns/pair\t hits: " << hitCount << " / " << queryCount <<
+      (nearest == expected ? "" : "\t MISMATCH") << "\n";
   }
+}
 
-  void render(sf::RenderWindow& renderWindow, f32 tileSize, sf::Vector3f cameraPosition) {
+// Imports the same stack of floors with 1, 2, 4 and 8 loader threads. The test maps are
+// repeated to make up floorCount floors, which is closer to what a big world has.
+void runLoadBenchmark(const std::string& baseFilename, uint32 mapCount, uint32 floorCount, uint32 runCount)
+{
+  std::vector<std::string> filenames(floorCount);
+  for(uint32 i = 0; i < floorCount; i++) filenames[i] = baseFilename + std::to_string(i % mapCount + 1) + ".png";
 
-    sf::Vector2u screenResolution  = renderWindow.getSize();
-    sf::Vector2f resolutionInTiles ((f32)screenResolution.x / tileSize, (f32)screenResolution.y / tileSize);
-    sf::Vector2f halfResInTiles    (resolutionInTiles.x / 2.0f, resolutionInTiles.y / 2.0f);
+  const uint32 threadCounts[] = {1, 2, 4, 8};
+  for(uint32 threadCount : threadCounts)
+  {
+    ThreadPool pool(threadCount);
+    sf::Clock clock;
+    for(uint32 run = 0; run < runCount; run++)
+    {
+      Grid3D tiles;
+      std::vector<sf::Vector2u> layerSizes;
+      if(!Level::importFromImages(filenames, pool, tiles, layerSizes)) return;
+    }
+    f32 loadTime = clock.getElapsedTime().asSeconds() * 1000.0f / (f32)runCount;
 
-    int32 startZ = std::max((int32)tileMap3D.size()-1, (int32)0);
+    std::cout << floorCount << " floors, " << threadCount << " threads: " << loadTime << " ms\n";
+  }
+}
 
-    for(int32 z = startZ; z >= (int32)cameraPosition.z; --z)
+// Casts random rays from random spots of a generated world, every chunk resident, in batches
+// the way lighting or line of sight would. Meant to stay above a million rays a second.
+void runRaycastBenchmark(int32 worldSize, uint32 rayCount, f32 maxDistance)
+{
+  Level level;
+  level.setSource(std::make_unique<GeneratedChunkSource>(sf::Vector3i(worldSize, worldSize, 1)));
+  level.updateResidentChunks(sf::IntRect(0, 0, worldSize, worldSize), sf::Vector3f(0.0f, 0.0f, 0.0f));
+  level.finishLoading();
+
+  const uint32 batchSize = 1024;
+  std::vector<Ray> rays(batchSize);
+  std::vector<RaycastHit> hits(batchSize);
+  uint32 seed = 12345, hitCount = 0;
+  f32 totalDistance = 0.0f, castTime = 0.0f;
+  sf::Clock clock;
+
+  for(uint32 first = 0; first < rayCount; first += batchSize)
+  {
+    for(Ray& ray : rays)
     {
-      const TileMap2D& tileMap2D = tileMap3D[z];
-      uint32 mapHeight = (uint32)tileMap2D.size();
-      if(mapHeight > 0)
-      {
-	uint32 mapWidth = (uint32)tileMap2D[0].size();
-	for(uint32 y = 0; y < mapHeight; y++)
-	  for(uint32 x = 0; x < mapWidth; x++)
-	  {
-	    TILE_TYPE tileType = tileMap2D[y][x];
-	    if(tileType == TT_VOID) continue;
+      ray.origin.x = randomUnit(seed) * (f32)worldSize;
+      ray.origin.y = randomUnit(seed) * (f32)worldSize;
+      f32 angle = randomUnit(seed) * 6.2831853f;
+      ray.direction = sf::Vector2f(std::cos(angle), std::sin(angle));
+      ray.maxDistance = maxDistance;
+    }
 
-	    sf::Vector2f position((x - cameraPosition.x - halfResInTiles.x) * tileSize,
-				  (y - cameraPosition.y - halfResInTiles.y) * tileSize);
+    clock.restart();
+    level.raycast(rays.data(), batchSize, 0, hits.data());
+    castTime += clock.getElapsedTime().asSeconds();
 
-	    sf::RectangleShape rs(sf::Vector2f(tileSize, tileSize));
-	    rs.setPosition(position);
-	    switch(tileType)
-	    {
-	    case TT_WALL :
-	      rs.setFillColor(sf::Color::Black);
-	      break;
-	    case TT_FLOOR :
-	      rs.setFillColor(sf::Color::White);
-	      break;
-	    case TT_STAIRCASE_UP :
-	      rs.setFillColor(staircaseUpColor);
-	      break;
-	    case TT_STAIRCASE_DOWN :
-	      rs.setFillColor(staircaseDownColor);
-	      break;
-	    }
-	    renderWindow.draw(rs);
-	  }
-      } else {std::cout << "Map is not properly loaded height is equal to 0\n"; }
+    for(const RaycastHit& hit : hits)
+    {
+      hitCount += hit.hit;
+      totalDistance += hit.distance;
     }
   }
 
-  TILE_TYPE getTile(const sf::Vector3f position) const
+  uint32 castCount = (rayCount + batchSize - 1) / batchSize * batchSize;
+  std::cout << castCount << " rays, max distance " << maxDistance << ", hits: " << hitCount << "\t mean distance: " << totalDistance / (f32)castCount << "\n";
+  std::cout << "raycast: " << castTime * 1e9f / (f32)castCount << " ns/ray\t " << (f32)castCount / castTime / 1e6f << " M rays/s\n";
+}
+
+// Computes the field of view from random spots of a generated world, every chunk resident,
+// the way it is done each time the player steps onto another tile.
+void runFieldOfViewBenchmark(int32 worldSize, uint32 computeCount, int32 radius)
+{
+  ChunkedWorld world;
+  world.setSource(std::make_unique<GeneratedChunkSource>(sf::Vector3i(worldSize, worldSize, 1)));
+  world.updateResidency(sf::IntRect(0, 0, worldSize, worldSize), 0);
+  world.finishLoading();
+
+  FieldOfView fieldOfView;
+  uint32 seed = 12345, visibleCount = 0;
+  f32 computeTime = 0.0f, maxComputeTime = 0.0f;
+  sf::Clock clock;
+
+  for(uint32 i = 0; i < computeCount; i++)
+  {
+    int32 x = (int32)((nextRandom(seed) >> 8) % (uint32)worldSize);
+    int32 y = (int32)((nextRandom(seed) >> 8) % (uint32)worldSize);
+
+    clock.restart();
+    fieldOfView.compute(world, sf::Vector3i(x, y, 0), radius);
+    f32 time = clock.getElapsedTime().asSeconds();
+    computeTime += time;
+    maxComputeTime = std::max(maxComputeTime, time);
+
+    for(int32 tileY = y - radius; tileY <= y + radius; tileY++)
+      for(int32 tileX = x - radius; tileX <= x + radius; tileX++)
+	visibleCount += fieldOfView.isVisible(tileX, tileY, 0);
+  }
+
+  std::cout << computeCount << " fields of view, radius " << radius << ", mean visible tiles: " << visibleCount / computeCount << "\n";
+  std::cout << "compute: " << computeTime * 1e6f / (f32)computeCount << " us\t worst: " << maxComputeTime * 1e6f << " us\n";
+}
+
+// Renders the same frames through the per tile, the batched and the chunk texture level path
+// with vsync off, so draw calls and frame time can be compared on the same map.
+void runRenderBenchmark(sf::RenderWindow& window, Level& level, f32 tileSize, sf::Vector3f cameraPosition,
+			sf::Vector3f playerPosition, uint32 frameCount)
+{
+  window.setVerticalSyncEnabled(false);
+  level.setRevealAll(true);
+  level.updateResidentChunks(level.getVisibleTiles(window.getSize(), tileSize, cameraPosition), playerPosition);
+  level.finishLoading();
+
+  SfmlRenderer renderer(window);
+  const char* passNames[] = {"per tile: ", "batched:  ", "cached:   "};
+  for(uint32 pass = 0; pass < 3; pass++)
   {
-    if(tileMap3D.size() > position.z && tileMap3D[0].size() > position.y && tileMap3D[0].size() > position.x)
+    RenderStats stats = {};
+    sf::Clock clock;
+    for(uint32 frame = 0; frame < frameCount; frame++)
     {
-      return tileMap3D[(uint32)position.z][(uint32)position.y][(uint32)position.x];
+      sf::Event event;
+      while (window.pollEvent(event)) {}
+
+      window.clear(sf::Color::Black);
+      if(pass == 0)      stats = level.renderPerTile(window, tileSize, cameraPosition);
+      else if(pass == 1) stats = level.renderBatched(window, tileSize, cameraPosition);
+      else               stats = level.render(renderer, tileSize, cameraPosition);
+      window.display();
     }
-    return TT_WALL;
+    f32 frameTime = clock.getElapsedTime().asSeconds() * 1000.0f / (f32)frameCount;
+
+    std::cout << passNames[pass] << "draw calls: " << stats.drawCalls <<
+      "\t tiles: " << stats.tilesDrawn << "\t frame time: " << frameTime << " ms\n";
   }
+}
 
-  bool isSolid(const sf::Vector2f& position, uint32 level) const
+// Renders frames of the level and the player into memory on the CPU, no window or GPU needed.
+// The last frame is written to outFilename if there is one, to compare against a known good image.
+void runCpuRenderBenchmark(Level& level, const Player& player, sf::Vector2u resolution, f32 tileSize,
+			   sf::Vector3f cameraPosition, uint32 frameCount, const std::string& outFilename)
+{
+  CpuRenderer renderer(resolution);
+  level.setRevealAll(true);
+  level.updateResidentChunks(level.getVisibleTiles(resolution, tileSize, cameraPosition), player.position);
+  level.finishLoading();
+
+  RenderStats stats = {};
+  f32 maxFrameTime = 0.0f;
+  sf::Clock clock, frameClock;
+  for(uint32 frame = 0; frame < frameCount; frame++)
   {
-    if(getTile({position.x, position.y, (f32)level}) == TT_WALL) return true;
-    return false;
+    frameClock.restart();
+    renderer.clear(sf::Color::Black);
+    stats = level.render(renderer, tileSize, cameraPosition);
+    player.render(renderer, tileSize, 1.0f);
+    maxFrameTime = std::max(maxFrameTime, frameClock.getElapsedTime().asSeconds());
   }
+  f32 frameTime = clock.getElapsedTime().asSeconds() * 1000.0f / (f32)frameCount;
 
-  bool doesIntersectWithSolid(const sf::FloatRect& rect, uint32 level) const
+  std::cout << "cpu " << resolution.x << "x" << resolution.y << ": draw calls: " << stats.drawCalls << "\t tiles: " << stats.tilesDrawn <<
+    "\t frame time: " << frameTime << " ms\t worst: " << maxFrameTime * 1000.0f << " ms\n";
+  if(!outFilename.empty() && !renderer.saveToFile(outFilename)) LOG_ERROR("Frame: " << outFilename << " couldn't be written !");
+}
+
+// FNV-1a, seed is the hash of whatever came before.
+uint64 hashBytes(const void* data, size_t size, uint64 seed = 14695981039346656037ull)
+{
+  const uint8* bytes = (const uint8*)data;
+  for(size_t i = 0; i < size; i++) seed = (seed ^ bytes[i]) * 1099511628211ull;
+  return seed;
+}
+
+// Input of a made up player who picks which movement keys to hold every half second. The same
+// seed always gives the same keys.
+class ScriptedInput {
+private:
+  uint32 seed;
+public:
+  explicit ScriptedInput(uint32 seed) : seed(seed) {}
+
+  // input is the one from the tick before, only presses and releases are new each tick.
+  void next(uint64 tick, Input& input)
   {
-    if(isSolid({rect.left, rect.top}, level) ||
-       isSolid({rect.left + rect.width, rect.top}, level) ||
-       isSolid({rect.left + rect.width, rect.top + rect.height}, level) ||
-       isSolid({rect.left, rect.top + rect.height}, level)
-       ) return true;
+    input.clear();
+    if(tick % 60 != 0) return;
 
-    // sf::Vector2f center(rect.left + rect.width / 2.0f, rect.top + rect.height / 2.0f);
-    return false;
+    const sf::Keyboard::Key keys[] = {sf::Keyboard::W, sf::Keyboard::A, sf::Keyboard::S, sf::Keyboard::D};
+    for(sf::Keyboard::Key key : keys)
+    {
+      bool down = (nextRandom(seed) >> 31) != 0;
+      if(down == input.keysDown[key]) continue;
+      if(down) input.keysPressed[key] = true;
+      else     input.keysReleased[key] = true;
+      input.keysDown[key] = down;
+    }
   }
+};
 
-  static std::list<sf::Vector2i> getCollidingTiles(const sf::Vector2f& startPosition, const sf::Vector2f& deltaVector)
-  {
-    std::list<sf::Vector2i> result;
-    sf::Vector2i startPositionI ((int)(deltaVector.x >= 0 ? startPosition.x : startPosition.x + deltaVector.x),
-				 (int)(deltaVector.y >= 0 ? startPosition.y : startPosition.y + deltaVector.y));
+// Input log file: an InputLogHeader, then one entry for every tick a key went down or up in. An
+// entry is a varint of the ticks since the entry before (since tick 0 for the first), a varint
+// key count and a key and INPUT_LOG_FLAG byte per key. Ticks without any keys take no space.
+const char   inputLogMagic[4] = {'Z', 'I', 'N', 'P'};
+const uint32 inputLogVersion  = 2;
+
+enum INPUT_LOG_FLAG {
+  ILF_PRESSED  = 1,
+  ILF_RELEASED = 2,
+  ILF_DOWN     = 4
+};
+
+struct InputLogHeader {
+  char   magic[4];
+  uint32 version;
+  uint64 tickCount;
+  // Hash the recorded run ended with, see runHeadlessSimulation. A replay ending with another
+  // one went a different way.
+  uint64 stateHash;
+  f32    stepTime;
+  f32    startX;
+  f32    startY;
+  f32    startZ;
+  // Screen and tile size the run was recorded with, they decide which chunks are resident and so
+  // which walls the player runs into.
+  uint16 resolutionX;
+  uint16 resolutionY;
+  f32    tileSize;
+};
+static_assert(sizeof(InputLogHeader) == 48, "InputLogHeader layout is part of the file format");
+
+void appendVarint(std::vector<uint8>& bytes, uint64 value)
+{
+  for(; value >= 0x80; value >>= 7) bytes.push_back((uint8)(value | 0x80));
+  bytes.push_back((uint8)value);
+}
 
-    sf::Vector2i endPositionI ((int)(deltaVector.x >= 0 ? startPosition.x + deltaVector.x : startPosition.x),
-			       (int)(deltaVector.y >= 0 ? startPosition.y + deltaVector.y : startPosition.y));
+// False when the bytes run out first.
+bool readVarint(const uint8*& bytes, const uint8* end, uint64& value)
+{
+  value = 0;
+  for(uint32 shift = 0; bytes < end && shift < 64; shift += 7)
+  {
+    uint8 byte = *bytes++;
+    value |= (uint64)(byte & 0x7F) << shift;
+    if((byte & 0x80) == 0) return true;
+  }
+  return false;
+}
 
-    sf::Vector2i currentPosition = startPositionI;
+// Collects the key presses and releases of every simulation tick, kept in memory until saved.
+class InputRecorder {
+private:
+  std::vector<uint8> entries;
+  uint64 tickCount = 0;
+  uint64 lastEntryTick = 0;
+  std::vector<uint8> tickKeys;
+public:
+  // Called once per tick with the input the tick ran with.
+  void record(const Input& input)
+  {
+    tickKeys.clear();
+    for(uint32 key = 0; key < Input::keyCount; key++)
+      if(input.keysPressed[key] || input.keysReleased[key]) tickKeys.push_back((uint8)key);
 
-    while(currentPosition.y < endPositionI.y + 1)
+    if(!tickKeys.empty())
     {
-      while(currentPosition.x < endPositionI.x + 1)
+      appendVarint(entries, tickCount - lastEntryTick);
+      appendVarint(entries, tickKeys.size());
+      for(uint8 key : tickKeys)
       {
-	result.push_back({currentPosition.x, currentPosition.y});
-	currentPosition.x++;
+	entries.push_back(key);
+	entries.push_back((uint8)((input.keysPressed[key] ? ILF_PRESSED : 0) | (input.keysReleased[key] ? ILF_RELEASED : 0) |
+				  (input.keysDown[key] ? ILF_DOWN : 0)));
       }
-      currentPosition.y++;
+      lastEntryTick = tickCount;
     }
+    tickCount++;
+  }
 
-    return result;
+  uint64 getTickCount() const { return tickCount; }
+
+  bool save(const std::string& filename, sf::Vector3f startPosition, sf::Vector2u resolution, f32 tileSize, f32 stepTime,
+	    uint64 stateHash) const
+  {
+    InputLogHeader header = {};
+    memcpy(header.magic, inputLogMagic, sizeof(header.magic));
+    header.version   = inputLogVersion;
+    header.tickCount = tickCount;
+    header.stateHash = stateHash;
+    header.stepTime  = stepTime;
+    header.startX    = startPosition.x;
+    header.startY    = startPosition.y;
+    header.startZ    = startPosition.z;
+    header.resolutionX = (uint16)resolution.x;
+    header.resolutionY = (uint16)resolution.y;
+    header.tileSize    = tileSize;
+
+    std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+    if(!file) return false;
+    file.write((const char*)&header, sizeof(header));
+    if(!entries.empty()) file.write((const char*)&entries[0], entries.size());
+    return (bool)file;
   }
 };
 
-class Player {
-public:
-  sf::Vector3f position;
-  sf::Vector2f dimensions;
-  const float movementSpeed = 5.0f;
+// Plays a log made by InputRecorder back one tick at a time, the input of every tick comes out
+// exactly as it was recorded.
+class InputReplayer {
+private:
+  InputLogHeader header = {};
+  std::vector<uint8> entries;
+  size_t readOffset = 0;
+  uint64 nextEntryTick = 0;
+  bool hasEntry = false;
 
-  void move(const Input& input, const Level& level, f32 lastDelta)
+  void readEntryTick()
   {
-    sf::Vector2f deltaVector;
+    const uint8* bytes = entries.data() + readOffset;
+    uint64 tickDelta;
+    hasEntry = readVarint(bytes, entries.data() + entries.size(), tickDelta);
+    readOffset = (size_t)(bytes - entries.data());
+    nextEntryTick += tickDelta;
+  }
+public:
+  bool open(const std::string& filename)
+  {
+    std::ifstream file(filename, std::ios::binary);
+    if(!file || !file.read((char*)&header, sizeof(header)) || memcmp(header.magic, inputLogMagic, sizeof(header.magic)) != 0 ||
+       header.version != inputLogVersion) return false;
+
+    entries.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    readOffset = 0;
+    nextEntryTick = 0;
+    readEntryTick();
+    return true;
+  }
 
-    if(input.keysDown[sf::Keyboard::W]) deltaVector.y -= movementSpeed;
-    if(input.keysDown[sf::Keyboard::S]) deltaVector.y += movementSpeed;
+  const InputLogHeader& getHeader() const { return header; }
+  sf::Vector3f getStartPosition() const { return sf::Vector3f(header.startX, header.startY, header.startZ); }
+  sf::Vector2u getResolution() const { return sf::Vector2u(header.resolutionX, header.resolutionY); }
 
-    if(input.keysDown[sf::Keyboard::A]) deltaVector.x -= movementSpeed;
-    if(input.keysDown[sf::Keyboard::D]) deltaVector.x += movementSpeed;
+  // input is the one from the tick before, like for ScriptedInput::next.
+  void next(uint64 tick, Input& input)
+  {
+    input.clear();
+    if(!hasEntry || tick != nextEntryTick) return;
 
-    deltaVector *= lastDelta;
+    const uint8* bytes = entries.data() + readOffset;
+    const uint8* end   = entries.data() + entries.size();
+    uint64 keyCount;
+    if(!readVarint(bytes, end, keyCount) || keyCount > (uint64)(end - bytes) / 2)
+    {
+      LOG_ERROR("Input: log ends in the middle of tick " << tick << ", the rest is left out");
+      hasEntry = false;
+      return;
+    }
+    for(uint64 i = 0; i < keyCount; i++, bytes += 2)
+    {
+      uint8 key = bytes[0], flags = bytes[1];
+      input.keysPressed[key]  = (flags & ILF_PRESSED) != 0;
+      input.keysReleased[key] = (flags & ILF_RELEASED) != 0;
+      input.keysDown[key]     = (flags & ILF_DOWN) != 0;
+    }
+    readOffset = (size_t)(bytes - entries.data());
+    readEntryTick();
+  }
+};
 
-    sf::Vector3f newPosition (position.x + deltaVector.x, position.y + deltaVector.y, position.z);
+// The keypad + and - zoom in and out a little every tick they are held.
+const f32 zoomStep = 1.0f / 8.0f;
 
-    sf::FloatRect playerRect(position.x - dimensions.x / 2.0f, position.y - dimensions.y / 2.0f, dimensions.x, dimensions.y);
+void applyZoomKeys(const Input& input, f32& tileSize)
+{
+  if(input.keysDown[sf::Keyboard::Add])      tileSize += zoomStep;
+  if(input.keysDown[sf::Keyboard::Subtract]) tileSize -= zoomStep;
+}
 
-    // CollisionResult cr = level.checkCollisions(playerRect, deltaVector, (uint32)position.z);
-    // std::cout << "timeT: " << cr.timeT << "\t ws: " << cr.ws << "\t x: " << cr.collisionPoint.x <<
-    //   "\t y: " << cr.collisionPoint.y << std::endl;
+// One tick the way a replay runs it, and a recorded run too. The chunks it could touch are
+// streamed in and waited for before the player moves, streaming them in the background would tie
+// where the player ends up to loader timing.
+void runReplayableTick(Level& level, Player& player, const Input& input, sf::Vector2u resolution, f32& tileSize,
+		       sf::Vector3f cameraPosition, f32 stepTime)
+{
+  applyZoomKeys(input, tileSize);
+  level.updateResidentChunks(level.getVisibleTiles(resolution, tileSize, cameraPosition), player.position);
+  level.finishLoading();
+  player.move(input, level, stepTime);
+}
 
-    // if(cr.timeT == 1.0f) position = newPosition;
-  }
+// Runs tickCount fixed steps of the player moving through the level as fast as they go, no window
+// needed. Reports ticks per second and a hash of where the player was after every tick: the same
+// level, input and build always give the same hash, so a different one means movement changed.
+// nextInput(tick, input) fills in the input of each tick.
+template<typename NextInput>
+uint64 runHeadlessSimulation(Level& level, Player& player, sf::Vector2u resolution, f32 tileSize, sf::Vector3f cameraPosition,
+			     uint64 tickCount, f32 stepTime, NextInput nextInput)
+{
+  level.updateResidentChunks(level.getVisibleTiles(resolution, tileSize, cameraPosition), player.position);
+  level.finishLoading();
 
-  void render(sf::RenderWindow& renderWindow, f32 tileSize)
+  Input input;
+  uint64 stateHash = hashBytes(&player.position, sizeof(player.position));
+  sf::Clock clock;
+  for(uint64 tick = 0; tick < tickCount; tick++)
   {
-    sf::RectangleShape rs({dimensions.x * tileSize, dimensions.y * tileSize});
-    rs.setPosition({position.x * tileSize, position.y * tileSize});
-    // Setting draw origin to the center of the shape
-    rs.setOrigin(dimensions.x * tileSize / 2.0f, dimensions.y * tileSize / 2.0f);
-    rs.setFillColor(sf::Color::Magenta);
-    renderWindow.draw(rs);
+    nextInput(tick, input);
+    runReplayableTick(level, player, input, resolution, tileSize, cameraPosition, stepTime);
+    stateHash = hashBytes(&player.position, sizeof(player.position), stateHash);
   }
-};
+  real64 seconds = clock.getElapsedTime().asSeconds();
 
-struct IntersectionResult {
-  bool intersectionHappened;
-  sf::Vector2f intersectionPoint;
-};
+  std::cout << "headless: " << tickCount << " ticks in " << seconds << " s\t " << (real64)tickCount / std::max(seconds, 1e-9) <<
+    " ticks/s\t player at " << player.position.x << ", " << player.position.y << ", " << player.position.z <<
+    "\t state hash " << std::hex << stateHash << std::dec << "\n";
+  return stateHash;
+}
 
-IntersectionResult getPointOfIntersection(const sf::Vector2f& p0, const sf::Vector2f& p1,
-					  const sf::Vector2f& p2, const sf::Vector2f& p3)
+int main(int argc, char** argv)
 {
-  IntersectionResult result = {};
+  bool benchRender = argc > 1 && std::string(argv[1]) == "-bench-render";
+  // -record ../input.zinp plays as usual and saves the input of every tick when the window closes.
+  std::string recordFilename = argc > 2 && std::string(argv[1]) == "-record" ? argv[2] : "";
 
-  float s1_x, s1_y, s2_x, s2_y;
-  s1_x = p1.x - p0.x;     s1_y = p1.y - p0.y;
-  s2_x = p3.x - p2.x;     s2_y = p3.y - p2.y;
+  if(argc > 4 && std::string(argv[1]) == "-bake")
+  {
+    // -bake ../maps/test 3 ../maps/test.zlvl
+    Grid3D tiles;
+    std::vector<sf::Vector2u> layerSizes;
+    ThreadPool pool;
+    if(!Level::importFromImages(Level::getLayerFilenames(argv[2], (uint32)atoi(argv[3])), pool, tiles, layerSizes)) return 1;
+    if(!bakeLevelFile(tiles, layerSizes, argv[4]))
+    {
+      LOG_ERROR("Level: " << argv[4] << " couldn't be written !");
+      return 1;
+    }
+    return 0;
+  }
 
-  float s,t;
-  s = (-s1_y * (p0.x - p2.x) + s1_x * (p0.y - p2.y)) / (-s2_x * s1_y + s1_x * s2_y);
-  t = ( s2_x * (p0.y - p2.y) - s2_y * (p0.x - p2.x)) / (-s2_x * s1_y + s1_x * s2_y);
+  if(argc > 1 && std::string(argv[1]) == "-bench-palette")
+  {
+    runPaletteBenchmark(4096, 4);
+    return 0;
+  }
 
-  if (s >= 0 && s <= 1 && t >= 0 && t <= 1)
+  if(argc > 1 && std::string(argv[1]) == "-bench-load")
   {
-    // Collision detected
-    result.intersectionPoint.x = p0.x + (t * s1_x);
-    result.intersectionPoint.y = p0.y + (t * s1_y);
+    runLoadBenchmark("../maps/test", 3, 48, 10);
+    return 0;
+  }
 
-    result.intersectionHappened = true;
+  if(argc > 1 && std::string(argv[1]) == "-bench-world")
+  {
+    runWorldBenchmark(10000, 3, 200000);
+    return 0;
   }
-  else {
-    result.intersectionHappened = false;
+
+  if(argc > 1 && std::string(argv[1]) == "-bench-segments")
+  {
+    runSegmentBenchmark(1024, 20000);
+    return 0;
   }
 
-  return result;
-}
+  if(argc > 1 && std::string(argv[1]) == "-bench-fov")
+  {
+    runFieldOfViewBenchmark(1024, 10000, fieldOfViewRadius);
+    return 0;
+  }
 
-int main()
-{
-  sf::Vector2u resolution(1280, 720);
+  if(argc > 1 && std::string(argv[1]) == "-bench-ray")
+  {
+    runRaycastBenchmark(1024, 4000000, 64.0f);
+    return 0;
+  }
 
-  sf::RenderWindow window(sf::VideoMode(resolution.x, resolution.y), "Zhale");
-  window.setVerticalSyncEnabled(true);
-  window.setPosition({0,0});
+  if(argc > 1 && std::string(argv[1]) == "-bench-grid")
+  {
+    runGridBenchmark(2048, 2048, 8, 10000000);
+    return 0;
+  }
+
+  sf::Vector2u resolution(1280, 720);
+  if(!Logger::get().openFile("zhale.log")) LOG_WARNING("Log: zhale.log couldn't be opened, only logging to stdout");
 
   Input input;
   Level level;
   Player player;
   player.position   = sf::Vector3f(2.0f, 2.0f, 0);
+  player.previousPosition = player.position;
   player.dimensions = sf::Vector2f(0.5f, 0.5f);
-  if(!level.loadFromFile("../maps/test", 3))
+  // The baked level maps in constant time, the PNGs are only imported when it hasn't been baked
+  // or one of them was saved since. Only imported PNGs are hot reloaded.
+  uint64 bakedWriteTime = getFileWriteTime("../maps/test.zlvl");
+  bool layersEdited = false;
+  for(const std::string& filename : Level::getLayerFilenames("../maps/test", 3))
+    layersEdited = layersEdited || getFileWriteTime(filename) > bakedWriteTime;
+
+  bool levelLoaded = false;
+  if(bakedWriteTime != 0 && !layersEdited)
   {
-    std::cout << "Level couldn't be loaded \n";
-  };
+    levelLoaded = level.loadFromLevelFile("../maps/test.zlvl");
+    if(levelLoaded) LOG_INFO("Level: loaded ../maps/test.zlvl, edits to ../maps/test*.png aren't hot reloaded until it is baked again or deleted");
+  }
+  if(!levelLoaded)
+  {
+    if(bakedWriteTime == 0) LOG_INFO("Level: importing ../maps/test*.png, the level hasn't been baked into ../maps/test.zlvl");
+    else if(layersEdited)   LOG_INFO("Level: importing ../maps/test*.png, they were saved after ../maps/test.zlvl was baked");
+    levelLoaded = level.loadFromFile("../maps/test", 3);
+  }
+  if(!levelLoaded) LOG_ERROR("Level couldn't be loaded");
 
   // Centering the camera
   float tileSize = 64.0f;
   sf::Vector3f cameraPosition(-(f32)resolution.x / tileSize / 2.0f, - (f32)resolution.y / tileSize / 2.0f, 0);
-  f32 movementSpeed = 1.0f;
+
+  // The simulation runs at 120 Hz whatever the display does, so movement is the same everywhere.
+  const f32 stepTime = 1.0f / 120.0f;
+
+  if(argc > 2 && std::string(argv[1]) == "-headless")
+  {
+    // -headless 1000000 [seed]
+    ScriptedInput script(argc > 3 ? (uint32)atoi(argv[3]) : 1);
+    runHeadlessSimulation(level, player, resolution, tileSize, cameraPosition, (uint64)atoll(argv[2]), stepTime,
+			  [&script](uint64 tick, Input& input) { script.next(tick, input); });
+    return 0;
+  }
+
+  if(argc > 2 && std::string(argv[1]) == "-replay")
+  {
+    // -replay ../input.zinp
+    InputReplayer replayer;
+    if(!replayer.open(argv[2]))
+    {
+      LOG_ERROR("Input: " << argv[2] << " couldn't be loaded !");
+      return 1;
+    }
+    player.position = replayer.getStartPosition();
+    player.previousPosition = player.position;
+    const InputLogHeader& header = replayer.getHeader();
+    uint64 stateHash = runHeadlessSimulation(level, player, replayer.getResolution(), header.tileSize, cameraPosition, header.tickCount,
+					     header.stepTime, [&replayer](uint64 tick, Input& input) { replayer.next(tick, input); });
+    if(stateHash == header.stateHash) std::cout << "replay matches the recording\n";
+    else std::cout << "replay went a different way than the recording, recorded hash " << std::hex << header.stateHash << std::dec << "\n";
+    return stateHash == header.stateHash ? 0 : 1;
+  }
+
+  if(argc > 1 && std::string(argv[1]) == "-bench-render-cpu")
+  {
+    // -bench-render-cpu [frame.png]
+    runCpuRenderBenchmark(level, player, resolution, tileSize, cameraPosition, 500, argc > 2 ? argv[2] : "");
+    return 0;
+  }
+
+  sf::RenderWindow window(sf::VideoMode(resolution.x, resolution.y), "Zhale");
+  window.setVerticalSyncEnabled(true);
+  window.setPosition({0,0});
+  SfmlRenderer renderer(window);
+
+  // Only the first floors are waited for, everything after that streams in the background.
+  level.updateResidentChunks(level.getVisibleTiles(window.getSize(), tileSize, cameraPosition), player.position);
+  level.finishLoading();
   sf::Vector2i mousePosition;
   sf::Clock clock;
 
+  if(benchRender)
+  {
+    runRenderBenchmark(window, level, tileSize, cameraPosition, player.position, 500);
+    return 0;
+  }
+
+  // From here on the level, the player and the camera belong to the simulation thread. This one
+  // polls events and draws whatever snapshot the simulation published last, so a slow frame
+  // doesn't hold up a tick and the two overlap on machines with more than one core.
+  WindowInput windowInput;
+  windowInput.resolution = window.getSize();
+  TripleBuffer<FrameSnapshot> snapshots;
+  ChunkView chunkView;
+  std::atomic<bool> simulationRunning{true};
+
+  auto publishSnapshot = [&](uint64 tick, sf::Vector2i tickMousePosition, sf::Vector2u screenResolution) {
+    PROFILE_ZONE("snapshot");
+    FrameSnapshot& snapshot = snapshots.getWriteSlot();
+    snapshot.tick = tick;
+    snapshot.time = clock.getElapsedTime().asSeconds();
+    snapshot.tileSize = tileSize;
+    snapshot.cameraPosition = cameraPosition;
+    sf::Vector2f mousePositionInTiles(tickMousePosition.x / tileSize, tickMousePosition.y / tileSize);
+    snapshot.clearColor = level.isSolid(mousePositionInTiles, 0) ? sf::Color::Yellow : sf::Color::Black;
+    snapshot.player = player;
+    level.getVisibleChunks(screenResolution, tileSize, cameraPosition, snapshot.chunks);
+    snapshots.publish();
+  };
+  publishSnapshot(0, mousePosition, windowInput.resolution);
+
+  // Hashed the same way as runHeadlessSimulation, so a replay of the recording can be checked.
+  // A recorded run takes every tick through runReplayableTick at the resolution it started with
+  // and doesn't hot reload the map, both would make the replay go another way.
+  bool recording = !recordFilename.empty();
+  InputRecorder recorder;
+  sf::Vector3f startPosition = player.position;
+  sf::Vector2u startResolution = windowInput.resolution;
+  f32 startTileSize = tileSize;
+  uint64 stateHash = hashBytes(&player.position, sizeof(player.position));
+
+  std::thread simulation([&] {
+    PROFILE_THREAD("simulation");
+    FixedTimestep timestep(stepTime, 8);
+    sf::Clock stepClock;
+    uint64 tick = 0;
+    Input tickInput;
+    while(simulationRunning.load())
+    {
+      uint32 stepCount = timestep.advance(stepClock.restart().asSeconds());
+      if(stepCount == 0)
+      {
+	sf::sleep(sf::seconds(timestep.stepTime * (1.0f - timestep.getAlpha())));
+	continue;
+      }
+      PROFILE_ZONE("tick");
+
+      sf::Vector2i tickMousePosition;
+      sf::Vector2u screenResolution;
+      {
+	std::lock_guard<std::mutex> lock(windowInput.mutex);
+	tickInput = windowInput.input;
+	windowInput.input.clear();
+	tickMousePosition = windowInput.mousePosition;
+	screenResolution  = windowInput.resolution;
+      }
+
+      if(!recording)
+      {
+	PROFILE_ZONE("residency");
+	level.reloadChangedLayers();
+	level.updateResidentChunks(level.getVisibleTiles(screenResolution, tileSize, cameraPosition), player.position);
+      }
+
+      for(uint32 step = 0; step < stepCount; step++)
+      {
+	PROFILE_ZONE("move");
+	if(recording)
+	{
+	  recorder.record(tickInput);
+	  runReplayableTick(level, player, tickInput, startResolution, tileSize, cameraPosition, timestep.stepTime);
+	}
+	else
+	{
+	  applyZoomKeys(tickInput, tileSize);
+	  player.move(tickInput, level, timestep.stepTime);
+	}
+	stateHash = hashBytes(&player.position, sizeof(player.position), stateHash);
+	tickInput.clear();
+	tick++;
+      }
+
+      publishSnapshot(tick, tickMousePosition, screenResolution);
+    }
+  });
+
   // Test Stuff
   // ---------------
   sf::Vector2f points[] { sf::Vector2f(10,10), sf::Vector2f(150,150), sf::Vector2f(40,10), sf::Vector2f(100,150) };
 
   int currentPointIndex = 0;
 
+#ifdef ZHALE_PROFILE
+  // F1 shows and hides the frame graph, F12 writes the zones of every thread to a trace.
+  FrameTimeHistory frameTimes;
+  sf::Clock frameClock;
+  bool showFrameGraph = true;
+  uint32 frameNumber = 0;
+  PROFILE_THREAD("window");
+#endif
+
   while (window.isOpen())
   {
     sf::Vector2f& currentPoint = points[currentPointIndex];
 
-    f32 lastDelta = clock.getElapsedTime().asSeconds();
-    clock.restart();
-
-    input.clear();
-    sf::Event event;
-    while (window.pollEvent(event))
     {
-      switch (event.type){
-      case sf::Event::Closed :
-	window.close();
-	break;
-      case sf::Event::KeyPressed :
-	input.keysPressed[event.key.code] = true;
-	input.keysDown   [event.key.code] = true;
-	break;
-      case sf::Event::KeyReleased :
-	input.keysReleased[event.key.code] = true;
-	input.keysDown    [event.key.code] = false;
-	break;
-      case sf::Event::MouseMoved :
-	mousePosition = sf::Mouse::getPosition(window);
-	break;
+      PROFILE_ZONE("input");
+      sf::Event event;
+      while (window.pollEvent(event))
+      {
+	switch (event.type){
+	case sf::Event::Closed :
+	  window.close();
+	  break;
+	case sf::Event::KeyPressed :
+	  input.keysPressed[event.key.code] = true;
+	  input.keysDown   [event.key.code] = true;
+	  break;
+	case sf::Event::KeyReleased :
+	  input.keysReleased[event.key.code] = true;
+	  input.keysDown    [event.key.code] = false;
+	  break;
+	case sf::Event::MouseMoved :
+	  mousePosition = sf::Mouse::getPosition(window);
+	  break;
+	}
       }
+
+      if(input.keysPressed[sf::Keyboard::Q]) window.close();
+
+      // Presses and releases stay in windowInput until a tick has seen them, a frame may see none.
+      std::lock_guard<std::mutex> lock(windowInput.mutex);
+      windowInput.input.add(input);
+      windowInput.mousePosition = mousePosition;
+      windowInput.resolution    = window.getSize();
     }
 
-    if(input.keysPressed[sf::Keyboard::Q]) window.close();
+#ifdef ZHALE_PROFILE
+    frameTimes.add(frameClock.restart().asSeconds() * 1000.0f);
+    if(input.keysPressed[sf::Keyboard::F1]) showFrameGraph = !showFrameGraph;
+    if(input.keysPressed[sf::Keyboard::F12])
+    {
+      if(Profiler::get().writeChromeTrace("zhale_trace.json")) LOG_INFO("Profiler: trace written to zhale_trace.json");
+      else LOG_ERROR("Profiler: zhale_trace.json couldn't be written !");
+    }
+    // Text needs a font the repo doesn't ship, so the percentiles go in the title bar instead.
+    if(++frameNumber % 30 == 0)
+    {
+      std::ostringstream title;
+      title << std::fixed << std::setprecision(1) << "Zhale  p50 " << frameTimes.getPercentile(50.0f) <<
+	" ms  p95 " << frameTimes.getPercentile(95.0f) << " ms  p99 " << frameTimes.getPercentile(99.0f) << " ms";
+      window.setTitle(title.str());
+    }
+#endif
+    input.clear();
 
     // if(input.keysDown[sf::Keyboard::W]) cameraPosition.y -= movementSpeed;
     // if(input.keysDown[sf::Keyboard::S]) cameraPosition.y += movementSpeed;
@@ -343,17 +3675,20 @@ int main()
     // if(input.keysDown[sf::Keyboard::A]) cameraPosition.x -= movementSpeed;
     // if(input.keysDown[sf::Keyboard::D]) cameraPosition.x += movementSpeed;
 
-    if(input.keysDown[sf::Keyboard::Add])      tileSize += movementSpeed / 4.0f;
-    if(input.keysDown[sf::Keyboard::Subtract]) tileSize -= movementSpeed / 4.0f;
-
-    sf::Vector2f mousePositionInTiles(mousePosition.x / tileSize, mousePosition.y / tileSize);
-
-    if(level.isSolid(mousePositionInTiles, 0)) window.clear(sf::Color::Yellow);
-    else window.clear(sf::Color::Black);
-
-    level.render(window, tileSize, cameraPosition);
-    player.move(input, level, lastDelta);
-    player.render(window, tileSize);
+    {
+      PROFILE_ZONE("render");
+      const FrameSnapshot& snapshot = snapshots.read();
+      // The player is drawn between its last two positions by how far the display is past the
+      // tick, see FixedTimestep::getAlpha.
+      f32 alpha = std::min((clock.getElapsedTime().asSeconds() - snapshot.time) / stepTime, 1.0f);
+
+      renderer.clear(snapshot.clearColor);
+      chunkView.render(renderer, snapshot.chunks, snapshot.tileSize, snapshot.cameraPosition);
+      snapshot.player.render(renderer, snapshot.tileSize, alpha);
+#ifdef ZHALE_PROFILE
+      if(showFrameGraph) renderFrameGraph(renderer, frameTimes);
+#endif
+    }
 
     // if(input.keysDown[sf::Keyboard::A]) currentPoint.x -= movementSpeed;
     // if(input.keysDown[sf::Keyboard::D]) currentPoint.x += movementSpeed;
@@ -383,8 +3718,18 @@ int main()
     // window.draw(&line[2], 2, sf::Lines);
     // if(ir.intersectionHappened) window.draw(rectangle);
 
+    PROFILE_ZONE("display");
     window.display();
   }
 
+  simulationRunning = false;
+  simulation.join();
+
+  if(recording)
+  {
+    if(recorder.save(recordFilename, startPosition, startResolution, startTileSize, stepTime, stateHash))
+      LOG_INFO("Input: " << recorder.getTickCount() << " ticks recorded to " << recordFilename);
+    else LOG_ERROR("Input: " << recordFilename << " couldn't be written !");
+  }
   return 0;
 }
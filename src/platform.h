@@ -0,0 +1,300 @@
+#ifndef ZHALE_PLATFORM_H
+#define ZHALE_PLATFORM_H
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define ZHALE_X64 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+// MSVC lets any function use AVX2 intrinsics, gcc and clang need them marked.
+#define ZHALE_TARGET_AVX2
+#else
+#define ZHALE_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+// SSE2 is always there on x64, AVX2 needs both the CPU and the OS saving the ymm registers.
+inline bool cpuSupportsAvx2()
+{
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 0);
+  if(info[0] < 7) return false;
+  __cpuid(info, 1);
+  bool osSavesYmm = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+  __cpuidex(info, 7, 0);
+  return osSavesYmm && (info[1] & (1 << 5)) != 0;
+#else
+  return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+#endif
+
+// Read only view of a whole file. Nothing is read up front, the OS pages the
+// file in as it is touched and shares the pages between processes.
+class MappedFile {
+private:
+  const void* data = nullptr;
+  size_t size = 0;
+#ifdef _WIN32
+  HANDLE file    = INVALID_HANDLE_VALUE;
+  HANDLE mapping = NULL;
+#endif
+public:
+  MappedFile() {}
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile() { close(); }
+
+  bool open(const std::string& filename)
+  {
+    close();
+#ifdef _WIN32
+    file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER fileSize;
+    if(!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) { close(); return false; }
+
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if(mapping == NULL) { close(); return false; }
+
+    data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if(data == nullptr) { close(); return false; }
+    size = (size_t)fileSize.QuadPart;
+#else
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+
+    struct stat fileStat;
+    if(fstat(fd, &fileStat) != 0 || fileStat.st_size == 0) { ::close(fd); return false; }
+
+    void* view = mmap(nullptr, (size_t)fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file alive on its own.
+    ::close(fd);
+    if(view == MAP_FAILED) return false;
+
+    data = view;
+    size = (size_t)fileStat.st_size;
+#endif
+    return true;
+  }
+
+  void close()
+  {
+#ifdef _WIN32
+    if(data) UnmapViewOfFile(data);
+    if(mapping != NULL) CloseHandle(mapping);
+    if(file != INVALID_HANDLE_VALUE) CloseHandle(file);
+    mapping = NULL;
+    file    = INVALID_HANDLE_VALUE;
+#else
+    if(data) munmap(const_cast<void*>(data), size);
+#endif
+    data = nullptr;
+    size = 0;
+  }
+
+  const void* getData() const { return data; }
+  size_t getSize() const { return size; }
+  bool isOpen() const { return data != nullptr; }
+};
+
+// Last write time of a file, only good for comparing against another file's. 0 when the file
+// doesn't exist.
+inline uint64_t getFileWriteTime(const std::string& filename)
+{
+#ifdef _WIN32
+  WIN32_FILE_ATTRIBUTE_DATA attributes = {};
+  if(!GetFileAttributesExA(filename.c_str(), GetFileExInfoStandard, &attributes)) return 0;
+  return (uint64_t)attributes.ftLastWriteTime.dwHighDateTime << 32 | attributes.ftLastWriteTime.dwLowDateTime;
+#else
+  struct stat fileStat;
+  if(stat(filename.c_str(), &fileStat) != 0) return 0;
+#ifdef __linux__
+  return (uint64_t)fileStat.st_mtim.tv_sec * 1000000000u + (uint64_t)fileStat.st_mtim.tv_nsec;
+#else
+  return (uint64_t)fileStat.st_mtime * 1000000000u;
+#endif
+#endif
+}
+
+// Tells which of a set of files were written since the last poll, without blocking. Linux gets
+// inotify events for the directories holding the files, Windows gets a change notification per
+// directory and then compares write times, anything else compares modification times every poll.
+class FileWatcher {
+private:
+  std::vector<std::string> filenames;
+  std::vector<std::string> directories;
+  // Directory every file sits in, as an index into directories.
+  std::vector<size_t> fileDirectories;
+#if defined(_WIN32)
+  std::vector<HANDLE> changeHandles;
+  std::vector<FILETIME> writeTimes;
+
+  static FILETIME getWriteTime(const std::string& filename)
+  {
+    WIN32_FILE_ATTRIBUTE_DATA attributes = {};
+    GetFileAttributesExA(filename.c_str(), GetFileExInfoStandard, &attributes);
+    return attributes.ftLastWriteTime;
+  }
+#elif defined(__linux__)
+  int inotifyFd = -1;
+  std::vector<int> watchDescriptors;
+#else
+  std::vector<time_t> writeTimes;
+
+  static time_t getWriteTime(const std::string& filename)
+  {
+    struct stat fileStat;
+    return stat(filename.c_str(), &fileStat) == 0 ? fileStat.st_mtime : 0;
+  }
+#endif
+
+  static std::string getDirectory(const std::string& filename)
+  {
+    size_t slash = filename.find_last_of("/\\");
+    return slash == std::string::npos ? std::string(".") : filename.substr(0, slash);
+  }
+
+  static std::string getName(const std::string& filename)
+  {
+    size_t slash = filename.find_last_of("/\\");
+    return slash == std::string::npos ? filename : filename.substr(slash + 1);
+  }
+public:
+  FileWatcher() {}
+  FileWatcher(const FileWatcher&) = delete;
+  FileWatcher& operator=(const FileWatcher&) = delete;
+  ~FileWatcher() { stop(); }
+
+  bool watch(const std::vector<std::string>& watchedFiles)
+  {
+    stop();
+    filenames = watchedFiles;
+    for(const std::string& filename : filenames)
+    {
+      std::string directory = getDirectory(filename);
+      size_t index = 0;
+      while(index < directories.size() && directories[index] != directory) index++;
+      if(index == directories.size()) directories.push_back(directory);
+      fileDirectories.push_back(index);
+    }
+
+#if defined(_WIN32)
+    for(const std::string& directory : directories)
+    {
+      HANDLE handle = FindFirstChangeNotificationA(directory.c_str(), FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+      if(handle == INVALID_HANDLE_VALUE) { stop(); return false; }
+      changeHandles.push_back(handle);
+    }
+    for(const std::string& filename : filenames) writeTimes.push_back(getWriteTime(filename));
+#elif defined(__linux__)
+    inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(inotifyFd < 0) return false;
+    for(const std::string& directory : directories)
+    {
+      // Editors often write a temporary file and rename it over the old one, so renames count too.
+      int descriptor = inotify_add_watch(inotifyFd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+      if(descriptor < 0) { stop(); return false; }
+      watchDescriptors.push_back(descriptor);
+    }
+#else
+    for(const std::string& filename : filenames) writeTimes.push_back(getWriteTime(filename));
+#endif
+    return true;
+  }
+
+  void stop()
+  {
+#if defined(_WIN32)
+    for(HANDLE handle : changeHandles) FindCloseChangeNotification(handle);
+    changeHandles.clear();
+    writeTimes.clear();
+#elif defined(__linux__)
+    if(inotifyFd >= 0) ::close(inotifyFd);
+    inotifyFd = -1;
+    watchDescriptors.clear();
+#else
+    writeTimes.clear();
+#endif
+    filenames.clear();
+    directories.clear();
+    fileDirectories.clear();
+  }
+
+  // Indices into the watched files of the ones that changed, each listed once.
+  std::vector<size_t> poll()
+  {
+    std::vector<size_t> changed;
+#if defined(_WIN32)
+    for(size_t directory = 0; directory < changeHandles.size(); directory++)
+    {
+      if(WaitForSingleObject(changeHandles[directory], 0) != WAIT_OBJECT_0) continue;
+      FindNextChangeNotification(changeHandles[directory]);
+
+      for(size_t i = 0; i < filenames.size(); i++)
+      {
+	if(fileDirectories[i] != directory) continue;
+	FILETIME writeTime = getWriteTime(filenames[i]);
+	if(CompareFileTime(&writeTime, &writeTimes[i]) == 0) continue;
+	writeTimes[i] = writeTime;
+	changed.push_back(i);
+      }
+    }
+#elif defined(__linux__)
+    if(inotifyFd < 0) return changed;
+
+    alignas(inotify_event) char buffer[4096];
+    for(;;)
+    {
+      ssize_t length = read(inotifyFd, buffer, sizeof(buffer));
+      if(length <= 0) break;
+
+      for(ssize_t offset = 0; offset < length;)
+      {
+	const inotify_event* event = (const inotify_event*)(buffer + offset);
+	offset += (ssize_t)(sizeof(inotify_event) + event->len);
+	if(event->len == 0) continue;
+
+	for(size_t i = 0; i < filenames.size(); i++)
+	{
+	  if(watchDescriptors[fileDirectories[i]] != event->wd || getName(filenames[i]) != event->name) continue;
+	  bool listed = false;
+	  for(size_t index : changed) listed = listed || index == i;
+	  if(!listed) changed.push_back(i);
+	}
+      }
+    }
+#else
+    for(size_t i = 0; i < filenames.size(); i++)
+    {
+      time_t writeTime = getWriteTime(filenames[i]);
+      if(writeTime == writeTimes[i]) continue;
+      writeTimes[i] = writeTime;
+      changed.push_back(i);
+    }
+#endif
+    return changed;
+  }
+};
+
+#endif
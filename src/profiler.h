@@ -0,0 +1,205 @@
+#ifndef ZHALE_PROFILER_H
+#define ZHALE_PROFILER_H
+
+// PROFILE_ZONE("name") times the rest of the scope it is in. Zones only exist when ZHALE_PROFILE
+// is defined, otherwise the macros expand to nothing and no profiler code is compiled in.
+#ifdef ZHALE_PROFILE
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <algorithm>
+
+// Zones one thread finished, the oldest are overwritten once it is full. Only the owning thread
+// writes, anyone can read: a reader checks count again after copying and drops what the writer
+// may have overwritten meanwhile.
+class ProfileRing {
+public:
+  static const uint64_t capacity = 1 << 14;
+
+  struct Zone {
+    const char* name;
+    uint64_t start;
+    uint64_t end;
+  };
+
+  std::string threadName;
+  uint32_t threadId;
+
+  explicit ProfileRing(uint32_t threadId) : threadName("thread " + std::to_string(threadId)), threadId(threadId) {}
+
+  void add(const char* name, uint64_t start, uint64_t end)
+  {
+    uint64_t index = count.load(std::memory_order_relaxed);
+    Slot& slot = slots[index & (capacity - 1)];
+    slot.name.store(name, std::memory_order_relaxed);
+    slot.start.store(start, std::memory_order_relaxed);
+    slot.end.store(end, std::memory_order_relaxed);
+    count.store(index + 1, std::memory_order_release);
+  }
+
+  void copyZones(std::vector<Zone>& zones) const
+  {
+    uint64_t last  = count.load(std::memory_order_acquire);
+    uint64_t first = last > capacity ? last - capacity : 0;
+    size_t copyStart = zones.size();
+    for(uint64_t index = first; index < last; index++)
+    {
+      const Slot& slot = slots[index & (capacity - 1)];
+      zones.push_back(Zone{slot.name.load(std::memory_order_relaxed), slot.start.load(std::memory_order_relaxed),
+			   slot.end.load(std::memory_order_relaxed)});
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t overwritten = count.load(std::memory_order_relaxed);
+    overwritten = overwritten > capacity ? overwritten - capacity : 0;
+    if(overwritten > first)
+      zones.erase(zones.begin() + copyStart, zones.begin() + copyStart + (size_t)(std::min(overwritten, last) - first));
+  }
+private:
+  // Fields are atomics so a reader racing the writer gets a torn zone it throws away instead of
+  // undefined behaviour. Relaxed stores cost the same as plain ones.
+  struct Slot {
+    std::atomic<const char*> name;
+    std::atomic<uint64_t> start;
+    std::atomic<uint64_t> end;
+  };
+
+  Slot slots[capacity];
+  std::atomic<uint64_t> count{0};
+};
+
+// Owns a ring per thread that ever recorded a zone. Times are nanoseconds since the profiler
+// started.
+class Profiler {
+private:
+  std::mutex mutex;
+  std::vector<std::unique_ptr<ProfileRing>> rings;
+  std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+
+  ProfileRing* addRing()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    rings.emplace_back(new ProfileRing((uint32_t)rings.size() + 1));
+    return rings.back().get();
+  }
+public:
+  static Profiler& get()
+  {
+    static Profiler profiler;
+    return profiler;
+  }
+
+  uint64_t now() const
+  {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+  }
+
+  // The lock is only taken the first time a thread records.
+  ProfileRing& getThreadRing()
+  {
+    thread_local ProfileRing* ring = addRing();
+    return *ring;
+  }
+
+  void setThreadName(const char* name)
+  {
+    ProfileRing& ring = getThreadRing();
+    std::lock_guard<std::mutex> lock(mutex);
+    ring.threadName = name;
+  }
+
+  // Writes the zones every thread still holds as a Chrome trace, it opens in chrome://tracing
+  // and in Perfetto.
+  bool writeChromeTrace(const std::string& filename)
+  {
+    std::ofstream file(filename, std::ios::trunc);
+    if(!file) return false;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<ProfileRing::Zone> zones;
+    file << "{\"traceEvents\":[\n";
+    bool first = true;
+    for(const std::unique_ptr<ProfileRing>& ring : rings)
+    {
+      file << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << ring->threadId <<
+	",\"args\":{\"name\":\"" << ring->threadName << "\"}}";
+      first = false;
+
+      zones.clear();
+      ring->copyZones(zones);
+      for(const ProfileRing::Zone& zone : zones)
+      {
+	file << ",\n{\"name\":\"" << zone.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << ring->threadId <<
+	  ",\"ts\":" << zone.start / 1000 << "." << zone.start / 100 % 10 <<
+	  ",\"dur\":" << (zone.end - zone.start) / 1000 << "." << (zone.end - zone.start) / 100 % 10 << "}";
+      }
+    }
+    file << "\n]}\n";
+    return (bool)file;
+  }
+};
+
+class ProfileZone {
+private:
+  const char* name;
+  uint64_t start;
+public:
+  explicit ProfileZone(const char* name) : name(name), start(Profiler::get().now()) {}
+  ~ProfileZone()
+  {
+    Profiler& profiler = Profiler::get();
+    profiler.getThreadRing().add(name, start, profiler.now());
+  }
+};
+
+// Frame times of the last frames, in milliseconds, for the frame graph.
+class FrameTimeHistory {
+public:
+  static const uint32_t capacity = 240;
+
+  void add(float frameTime)
+  {
+    times[next] = frameTime;
+    next = (next + 1) % capacity;
+    if(count < capacity) count++;
+  }
+
+  uint32_t getCount() const { return count; }
+  // i = 0 is the oldest frame still kept.
+  float get(uint32_t i) const { return times[(next + capacity - count + i) % capacity]; }
+
+  // Frame time that percentile percent of the kept frames are at or under.
+  float getPercentile(float percent) const
+  {
+    if(count == 0) return 0.0f;
+    float sorted[capacity];
+    std::copy(times, times + count, sorted);
+    uint32_t rank = std::min((uint32_t)(percent / 100.0f * (float)count), count - 1);
+    std::nth_element(sorted, sorted + rank, sorted + count);
+    return sorted[rank];
+  }
+private:
+  float times[capacity] = {};
+  uint32_t next = 0;
+  uint32_t count = 0;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_ZONE(name) ProfileZone PROFILE_CONCAT(profileZone, __LINE__)(name)
+#define PROFILE_THREAD(name) Profiler::get().setThreadName(name)
+
+#else
+
+#define PROFILE_ZONE(name)
+#define PROFILE_THREAD(name)
+
+#endif
+
+#endif
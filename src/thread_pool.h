@@ -0,0 +1,95 @@
+#ifndef ZHALE_THREAD_POOL_H
+#define ZHALE_THREAD_POOL_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <algorithm>
+
+// Fixed set of worker threads eating tasks off a shared queue.
+class ThreadPool {
+private:
+  std::vector<std::thread> workers;
+  std::deque<std::function<void()>> tasks;
+  std::mutex mutex;
+  std::condition_variable taskAvailable;
+  std::condition_variable allDone;
+  unsigned runningCount = 0;
+  bool stopping = false;
+
+  void workerLoop()
+  {
+    for(;;)
+    {
+      std::function<void()> task;
+      {
+	std::unique_lock<std::mutex> lock(mutex);
+	taskAvailable.wait(lock, [this] { return stopping || !tasks.empty(); });
+	if(tasks.empty()) return;
+	task = std::move(tasks.front());
+	tasks.pop_front();
+	runningCount++;
+      }
+
+      task();
+
+      std::lock_guard<std::mutex> lock(mutex);
+      runningCount--;
+      if(tasks.empty() && runningCount == 0) allDone.notify_all();
+    }
+  }
+public:
+  // 0 threads means one per hardware thread.
+  explicit ThreadPool(unsigned threadCount = 0)
+  {
+    if(threadCount == 0) threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+    for(unsigned i = 0; i < threadCount; i++) workers.emplace_back(&ThreadPool::workerLoop, this);
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // Queued tasks are still run before the workers exit.
+  ~ThreadPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    taskAvailable.notify_all();
+    for(std::thread& worker : workers) worker.join();
+  }
+
+  void push(std::function<void()> task)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      tasks.push_back(std::move(task));
+    }
+    taskAvailable.notify_one();
+  }
+
+  // Runs the task before everything that is already queued.
+  void pushFront(std::function<void()> task)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      tasks.push_front(std::move(task));
+    }
+    taskAvailable.notify_one();
+  }
+
+  // Blocks until the queue is empty and no task is running.
+  void wait()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    allDone.wait(lock, [this] { return tasks.empty() && runningCount == 0; });
+  }
+
+  unsigned getThreadCount() const { return (unsigned)workers.size(); }
+};
+
+#endif